@@ -31,6 +31,7 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "bitmap-inl.h"
 
 #include "peri-mod.h"
 
@@ -75,12 +76,30 @@
 
 static u16 doneWork_param;
 
-/* On-demand model extraction when run without forkserver */
-#define MODEL_IF_LEN 100
+/* On-demand model extraction, see PM_ME_PARK_MAX and pm_model_registry */
+#define MODEL_IF_LEN PM_MODEL_PATH_MAX
 EXP_ST u8 *me_bin,
           *me_config,
           model_if[MODEL_IF_LEN];
 
+static s32 me_pid;                    /* me.py running in background      */
+static u32 me_run_num,                /* ME round of me_pid               */
+           me_case_rounds,            /* ME rounds had by current case    */
+           park_cnt;                  /* Testcases waiting for a model    */
+static u8  me_park_ok;                /* Park the case instead of waiting */
+static u8* park_buf[PM_ME_PARK_MAX];  /* Parked testcases and             */
+static u32 park_len[PM_ME_PARK_MAX],  /*   their lengths,                 */
+           park_rounds[PM_ME_PARK_MAX], /* ME rounds had so far,          */
+           park_gen[PM_ME_PARK_MAX];  /*   model generation they ran with */
+static struct pm_model_registry*
+           model_reg;                 /* Models published by instances    */
+static s32 model_reg_fd;              /* Registry file, flock()ed         */
+static u32 model_gen;                 /* Generation model_if comes from   */
+static u64 total_me_runs,             /* me.py invocations                */
+           total_parked,              /* Testcases parked                 */
+           total_park_drops,          /* ... or dropped, see me_park()    */
+           total_me_fails;            /* me.py runs that gave no model    */
+
 EXP_ST u8 *in_dir,                    /* Input directory with test cases  */
           *out_file,                  /* File to fuzz, if any             */
           *out_dir,                   /* Working & output directory       */
@@ -132,12 +151,28 @@ static s32 forksrv_pid,               /* PID of the fork server           */
 
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 
+static u8* trace_dump_dir;            /* AFL_DUMP_TRACES, for bitmap_bench */
+
+static u32 map_size = MAP_SIZE;       /* Live part of maps, from QEMU     */
+
+static const struct bitmap_ops*
+  bitmap_ops = &bitmap_scalar;        /* Kernels for trace_bits & co.     */
+
+static u8 trace_listed;               /* trace_bits[] all in in_shm->edges */
+
 EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
            virgin_hang[MAP_SIZE],     /* Bits we haven't seen in hangs    */
            virgin_crash[MAP_SIZE];    /* Bits we haven't seen in crashes  */
 
 static s32 shm_id;                    /* ID of the SHM region             */
 
+static s32 in_shm_id;                 /* ID of the testcase SHM region    */
+static struct pm_input_shm* in_shm;   /* SHM with current testcase        */
+static u64 total_tsl;                 /* Blocks translated by children    */
+static u64 total_restore_pages,       /* RAM pages restored, -pm-persist  */
+           total_restore_ns,          /* Time spent restoring RAM         */
+           total_fork_ns;             /* Fork server fork-to-run latency  */
+
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
                    clear_screen = 1,  /* Window resized?                  */
                    child_timed_out;   /* Traced process timed out?        */
@@ -282,7 +317,8 @@ enum {
   /* 13 */ STAGE_EXTRAS_UI,
   /* 14 */ STAGE_EXTRAS_AO,
   /* 15 */ STAGE_HAVOC,
-  /* 16 */ STAGE_SPLICE
+  /* 16 */ STAGE_SPLICE,
+  /* 17 */ STAGE_STREAM
 };
 
 /* Stage value types */
@@ -301,7 +337,8 @@ enum {
   /* 02 */ FAULT_CRASH,
   /* 03 */ FAULT_ERROR,
   /* 04 */ FAULT_NOINST,
-  /* 05 */ FAULT_NOBITS
+  /* 05 */ FAULT_NOBITS,
+  /* 06 */ FAULT_PARKED                /* Waits for a model, see me_park() */
 };
 
 
@@ -734,93 +771,65 @@ EXP_ST void read_bitmap(u8* fname) {
 }
 
 
-/* Check if the current execution path brings anything new to the table.
-   Update virgin bits to reflect the finds. Returns 1 if the only change is
-   the hit-count for a particular tuple; 2 if there are new tuples seen. 
-   Updates the map, so subsequent calls will always return 0.
+/* Save the classified trace of a new queue entry, so that the bitmap kernels
+   can be benchmarked on real maps (see experimental/bitmap_bench/). */
 
-   This function is called after every exec() on a fairly large buffer, so
-   it needs to be fast. We do this in 32-bit and 64-bit flavors. */
+static void dump_trace(u32 id) {
 
-#define FFL(_b) (0xffULL << ((_b) << 3))
-#define FF(_b)  (0xff << ((_b) << 3))
+  u8* fn = alloc_printf("%s/id:%06u.map", trace_dump_dir, id);
+  s32 fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-static inline u8 has_new_bits(u8* virgin_map) {
-
-#ifdef __x86_64__
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, trace_bits, map_size, fn);
+  close(fd);
 
-  u64* current = (u64*)trace_bits;
-  u64* virgin  = (u64*)virgin_map;
+  ck_free(fn);
 
-  u32  i = (MAP_SIZE >> 3);
+}
 
-#else
 
-  u32* current = (u32*)trace_bits;
-  u32* virgin  = (u32*)virgin_map;
+/* Check if the current execution path brings anything new to the table.
+   Update virgin bits to reflect the finds. Returns 1 if the only change is
+   the hit-count for a particular tuple; 2 if there are new tuples seen. 
+   Updates the map, so subsequent calls will always return 0.
 
-  u32  i = (MAP_SIZE >> 2);
+   This function is called after every exec() on a fairly large buffer, so
+   it needs to be fast. If QEMU listed every slot the exec touched, only those
+   are looked at; otherwise the work is done by one of the kernels in
+   bitmap-inl.h, picked at startup by setup_bitmap_ops(). */
 
-#endif /* ^__x86_64__ */
+static u8 has_new_bits_listed(u8* virgin_map) {
 
-  u8   ret = 0;
+  u32* edges = in_shm->edges;
+  u32  i     = in_shm->edge_num;
+  u8   ret   = 0;
 
   while (i--) {
 
-#ifdef __x86_64__
-
-    u64 cur = *current;
-    u64 vir = *virgin;
-
-#else
-
-    u32 cur = *current;
-    u32 vir = *virgin;
-
-#endif /* ^__x86_64__ */
-
-    /* Optimize for *current == ~*virgin, since this will almost always be the
-       case. */
+    u32 idx = *(edges++) & (map_size - 1);
+    u8  cur = trace_bits[idx], vir = virgin_map[idx];
 
     if (cur & vir) {
 
-      if (ret < 2) {
-
-        /* This trace did not have any new bytes yet; see if there's any
-           current[] byte that is non-zero when virgin[] is 0xff. */
+      if (vir == 0xff) ret = 2;
+      else if (!ret) ret = 1;
 
-#ifdef __x86_64__
+      virgin_map[idx] = vir & ~cur;
 
-        if (((cur & FFL(0)) && (vir & FFL(0)) == FFL(0)) ||
-            ((cur & FFL(1)) && (vir & FFL(1)) == FFL(1)) ||
-            ((cur & FFL(2)) && (vir & FFL(2)) == FFL(2)) ||
-            ((cur & FFL(3)) && (vir & FFL(3)) == FFL(3)) ||
-            ((cur & FFL(4)) && (vir & FFL(4)) == FFL(4)) ||
-            ((cur & FFL(5)) && (vir & FFL(5)) == FFL(5)) ||
-            ((cur & FFL(6)) && (vir & FFL(6)) == FFL(6)) ||
-            ((cur & FFL(7)) && (vir & FFL(7)) == FFL(7))) ret = 2;
-        else ret = 1;
-
-#else
-
-        if (((cur & FF(0)) && (vir & FF(0)) == FF(0)) ||
-            ((cur & FF(1)) && (vir & FF(1)) == FF(1)) ||
-            ((cur & FF(2)) && (vir & FF(2)) == FF(2)) ||
-            ((cur & FF(3)) && (vir & FF(3)) == FF(3))) ret = 2;
-        else ret = 1;
+    }
 
-#endif /* ^__x86_64__ */
+  }
 
-      }
+  return ret;
 
-      *virgin = vir & ~cur;
+}
 
-    }
+static inline u8 has_new_bits(u8* virgin_map) {
 
-    current++;
-    virgin++;
+  u8 ret;
 
-  }
+  if (trace_listed) ret = has_new_bits_listed(virgin_map);
+  else ret = bitmap_ops->has_new_bits(trace_bits, virgin_map, map_size);
 
   if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
 
@@ -834,29 +843,7 @@ static inline u8 has_new_bits(u8* virgin_map) {
 
 static u32 count_bits(u8* mem) {
 
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
-
-  while (i--) {
-
-    u32 v = *(ptr++);
-
-    /* This gets called on the inverse, virgin bitmap; optimize for sparse
-       data. */
-
-    if (v == 0xffffffff) {
-      ret += 32;
-      continue;
-    }
-
-    v -= ((v >> 1) & 0x55555555);
-    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
-    ret += (((v + (v >> 4)) & 0xF0F0F0F) * 0x01010101) >> 24;
-
-  }
-
-  return ret;
+  return bitmap_ops->count_bits(mem, map_size);
 
 }
 
@@ -867,23 +854,7 @@ static u32 count_bits(u8* mem) {
 
 static u32 count_bytes(u8* mem) {
 
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
-
-  while (i--) {
-
-    u32 v = *(ptr++);
-
-    if (!v) continue;
-    if (v & FF(0)) ret++;
-    if (v & FF(1)) ret++;
-    if (v & FF(2)) ret++;
-    if (v & FF(3)) ret++;
-
-  }
-
-  return ret;
+  return bitmap_ops->count_bytes(mem, map_size);
 
 }
 
@@ -893,26 +864,7 @@ static u32 count_bytes(u8* mem) {
 
 static u32 count_non_255_bytes(u8* mem) {
 
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
-
-  while (i--) {
-
-    u32 v = *(ptr++);
-
-    /* This is called on the virgin bitmap, so optimize for the most likely
-       case. */
-
-    if (v == 0xffffffff) continue;
-    if ((v & FF(0)) != FF(0)) ret++;
-    if ((v & FF(1)) != FF(1)) ret++;
-    if ((v & FF(2)) != FF(2)) ret++;
-    if ((v & FF(3)) != FF(3)) ret++;
-
-  }
-
-  return ret;
+  return bitmap_ops->count_non_255_bytes(mem, map_size);
 
 }
 
@@ -922,164 +874,71 @@ static u32 count_non_255_bytes(u8* mem) {
    is hit or not. Called on every new crash or hang, should be
    reasonably fast. */
 
-#define AREP4(_sym)   (_sym), (_sym), (_sym), (_sym)
-#define AREP8(_sym)   AREP4(_sym), AREP4(_sym)
-#define AREP16(_sym)  AREP8(_sym), AREP8(_sym)
-#define AREP32(_sym)  AREP16(_sym), AREP16(_sym)
-#define AREP64(_sym)  AREP32(_sym), AREP32(_sym)
-#define AREP128(_sym) AREP64(_sym), AREP64(_sym)
-
-static u8 simplify_lookup[256] = { 
-  /*    4 */ 1, 128, 128, 128,
-  /*   +4 */ AREP4(128),
-  /*   +8 */ AREP8(128),
-  /*  +16 */ AREP16(128),
-  /*  +32 */ AREP32(128),
-  /*  +64 */ AREP64(128),
-  /* +128 */ AREP128(128)
-};
-
-#ifdef __x86_64__
-
-static void simplify_trace(u64* mem) {
+static void simplify_trace(u8* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  bitmap_ops->simplify_trace(mem, map_size);
 
-  while (i--) {
-
-    /* Optimize for sparse bitmaps. */
-
-    if (*mem) {
-
-      u8* mem8 = (u8*)mem;
-
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
-      mem8[4] = simplify_lookup[mem8[4]];
-      mem8[5] = simplify_lookup[mem8[5]];
-      mem8[6] = simplify_lookup[mem8[6]];
-      mem8[7] = simplify_lookup[mem8[7]];
+  /* Every slot is non-zero now. */
 
-    } else *mem = 0x0101010101010101ULL;
-
-    mem++;
-
-  }
+  if (mem == trace_bits) trace_listed = 0;
 
 }
 
-#else
-
-static void simplify_trace(u32* mem) {
-
-  u32 i = MAP_SIZE >> 2;
-
-  while (i--) {
-
-    /* Optimize for sparse bitmaps. */
-
-    if (*mem) {
-
-      u8* mem8 = (u8*)mem;
-
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
-
-    } else *mem = 0x01010101;
-
-    mem++;
-  }
-
-}
-
-#endif /* ^__x86_64__ */
-
 
 /* Destructively classify execution counts in a trace. This is used as a
    preprocessing step for any newly acquired traces. Called on every exec,
-   must be fast. */
-
-static u8 count_class_lookup[256] = {
-
-  /* 0 - 3:       4 */ 0, 1, 2, 4,
-  /* 4 - 7:      +4 */ AREP4(8),
-  /* 8 - 15:     +8 */ AREP8(16),
-  /* 16 - 31:   +16 */ AREP16(32),
-  /* 32 - 127:  +96 */ AREP64(64), AREP32(64),
-  /* 128+:     +128 */ AREP128(128)
+   must be fast. A slot QEMU listed twice (its counter wrapped) must be
+   classified once, hence the two passes over the list. */
 
-};
-
-#ifdef __x86_64__
-
-static inline void classify_counts(u64* mem) {
+static void classify_counts_listed(void) {
 
-  u32 i = MAP_SIZE >> 3;
-
-  while (i--) {
+  static u8 cls[PM_EDGE_LIST_MAX];
 
-    /* Optimize for sparse bitmaps. */
+  u32* edges = in_shm->edges;
+  u32  mask  = map_size - 1, n = in_shm->edge_num, i;
 
-    if (*mem) {
+  for (i = 0; i < n; i++)
+    cls[i] = count_class_lookup[trace_bits[edges[i] & mask]];
 
-      u8* mem8 = (u8*)mem;
-
-      mem8[0] = count_class_lookup[mem8[0]];
-      mem8[1] = count_class_lookup[mem8[1]];
-      mem8[2] = count_class_lookup[mem8[2]];
-      mem8[3] = count_class_lookup[mem8[3]];
-      mem8[4] = count_class_lookup[mem8[4]];
-      mem8[5] = count_class_lookup[mem8[5]];
-      mem8[6] = count_class_lookup[mem8[6]];
-      mem8[7] = count_class_lookup[mem8[7]];
-
-    }
-
-    mem++;
-
-  }
+  for (i = 0; i < n; i++)
+    trace_bits[edges[i] & mask] = cls[i];
 
 }
 
-#else
+static inline void classify_counts(u8* mem) {
 
-static inline void classify_counts(u32* mem) {
+  if (mem == trace_bits && trace_listed) classify_counts_listed();
+  else bitmap_ops->classify_counts(mem, map_size);
 
-  u32 i = MAP_SIZE >> 2;
+}
 
-  while (i--) {
 
-    /* Optimize for sparse bitmaps. */
+/* Clear trace_bits[] before an exec, just the slots QEMU listed if it listed
+   all it touched. */
 
-    if (*mem) {
+static void reset_trace(void) {
 
-      u8* mem8 = (u8*)mem;
+  if (trace_listed) {
 
-      mem8[0] = count_class_lookup[mem8[0]];
-      mem8[1] = count_class_lookup[mem8[1]];
-      mem8[2] = count_class_lookup[mem8[2]];
-      mem8[3] = count_class_lookup[mem8[3]];
+    u32* edges = in_shm->edges;
+    u32  i     = in_shm->edge_num;
 
-    }
+    while (i--) trace_bits[*(edges++) & (map_size - 1)] = 0;
 
-    mem++;
+  } else memset(trace_bits, 0, map_size);
 
-  }
+  in_shm->edge_num = 0;
+  trace_listed = 0;
 
 }
 
-#endif /* ^__x86_64__ */
-
 
 /* Get rid of shared memory (atexit handler). */
 
 static void remove_shm(void) {
 
   shmctl(shm_id, IPC_RMID, NULL);
+  shmctl(in_shm_id, IPC_RMID, NULL);
 
 }
 
@@ -1090,14 +949,7 @@ static void remove_shm(void) {
 
 static void minimize_bits(u8* dst, u8* src) {
 
-  u32 i = 0;
-
-  while (i < MAP_SIZE) {
-
-    if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
-    i++;
-
-  }
+  bitmap_ops->minimize_bits(dst, src, map_size);
 
 }
 
@@ -1120,7 +972,7 @@ static void update_bitmap_score(struct queue_entry* q) {
   /* For every byte set in trace_bits[], see if there is a previous winner,
      and how it compares to us. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
 
     if (trace_bits[i]) {
 
@@ -1146,7 +998,7 @@ static void update_bitmap_score(struct queue_entry* q) {
        q->tc_ref++;
 
        if (!q->trace_mini) {
-         q->trace_mini = ck_alloc(MAP_SIZE >> 3);
+         q->trace_mini = ck_alloc(map_size >> 3);
          minimize_bits(q->trace_mini, trace_bits);
        }
 
@@ -1173,7 +1025,7 @@ static void cull_queue(void) {
 
   score_changed = 0;
 
-  memset(temp_v, 255, MAP_SIZE >> 3);
+  memset(temp_v, 255, map_size >> 3);
 
   queued_favored  = 0;
   pending_favored = 0;
@@ -1188,10 +1040,10 @@ static void cull_queue(void) {
   /* Let's see if anything in the bitmap isn't captured in temp_v.
      If yes, and if it has a top_rated[] contender, let's use it. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
     if (top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7)))) {
 
-      u32 j = MAP_SIZE >> 3;
+      u32 j = map_size >> 3;
 
       /* Remove all bits belonging to the current entry from temp_v. */
 
@@ -1220,33 +1072,420 @@ static void cull_queue(void) {
 
 EXP_ST void setup_shm(void) {
 
-  u8* shm_str;
+  u8* shm_str;
+
+  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+
+  memset(virgin_hang, 255, MAP_SIZE);
+  memset(virgin_crash, 255, MAP_SIZE);
+
+  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id < 0) PFATAL("shmget() failed");
+
+  atexit(remove_shm);
+
+  shm_str = alloc_printf("%d", shm_id);
+
+  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
+     we don't want them to detect instrumentation, since we won't be sending
+     fork server commands. This should be replaced with better auto-detection
+     later on, perhaps? */
+
+  if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
+
+  ck_free(shm_str);
+
+  trace_bits = shmat(shm_id, NULL, 0);
+  
+  if (!trace_bits) PFATAL("shmat() failed");
+
+  /* Testcase region. Unlike SHM_ENV_VAR, it's exported in dumb mode too,
+     as it's about delivering input, not detecting instrumentation. */
+
+  in_shm_id = shmget(IPC_PRIVATE, sizeof(struct pm_input_shm),
+                     IPC_CREAT | IPC_EXCL | 0600);
+
+  if (in_shm_id < 0) PFATAL("shmget() failed");
+
+  shm_str = alloc_printf("%d", in_shm_id);
+
+  setenv(PM_INPUT_SHM_ENV_VAR, shm_str, 1);
+
+  ck_free(shm_str);
+
+  in_shm = shmat(in_shm_id, NULL, 0);
+
+  if (in_shm == (void*)-1) PFATAL("shmat() failed");
+
+  /* Have QEMU list the map slots each exec touches, see PM_EDGE_LIST_MAX. */
+
+  in_shm->edge_log = !dumb_mode && !getenv("AFL_NO_SPARSE_MAP");
+
+}
+
+
+/* Write testcase in SHM to out_file, for ME which reads it from the file. */
+
+static void sync_out_file(void) {
+
+  s32 fd;
+
+  if (!out_file || !in_shm->used) return;
+
+  unlink(out_file); /* Ignore errors. */
+
+  fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+
+  ck_write(fd, in_shm->buf, in_shm->len, out_file);
+
+  close(fd);
+
+}
+
+
+/* Read back the testcase of the last exec, for ME and parking. */
+
+static u8* me_read_case(u32* len) {
+
+  struct stat st;
+  s32 fd;
+  u8* buf;
+
+  sync_out_file();
+
+  fd = open(out_file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) PFATAL("Unable to open '%s'", out_file);
+
+  *len = st.st_size;
+  buf  = ck_alloc_nozero(*len + 1);
+
+  ck_read(fd, buf, *len, out_file);
+  close(fd);
+
+  return buf;
+
+}
+
+
+/* Take the newest model in the registry as model_if, the one QEMU is run
+   with outside the fork server. The fork server switches on its own, see
+   afl_model_check() in QEMU. Returns 1 if model_if changed. */
+
+static u8 me_sync_model(void) {
+
+  u8  path[PM_MODEL_PATH_MAX];
+  u32 gen = model_reg->generation;
+
+  if (gen == model_gen || (gen & 1)) return 0;
+
+  /* An instance is publishing while we copy if generation moves. */
+
+  __sync_synchronize();
+  memcpy(path, model_reg->path, PM_MODEL_PATH_MAX);
+  __sync_synchronize();
+
+  if (model_reg->generation != gen) return 0;
+
+  path[PM_MODEL_PATH_MAX - 1] = 0;
+  strcpy((char*)model_if, (char*)path);
+  model_gen = gen;
+
+  return 1;
+
+}
+
+
+/* Is an ME round running, here or in another instance? */
+
+static u8 me_busy(void) {
+
+  s32 owner = model_reg->me_owner;
+
+  if (me_pid) return 1;
+
+  return owner && owner != getpid() && (!kill(owner, 0) || errno != ESRCH);
+
+}
+
+
+static void copy_file(u8* old_path, u8* new_path);
+
+/* Start me.py in the background, on a testcase that hit an unmodeled
+   peripheral, unless another instance is running ME; returns 0 then. me.py
+   starts from the model QEMU dumped along with the access (see
+   PM_AUP_MODEL_SUFFIX) and writes N/peripheral_model.json for round N. */
+
+static u8 me_start(u8* buf, u32 len) {
+
+  u8 *fn, *aup_fn, *model_fn;
+  s32 fd;
+
+  if (flock(model_reg_fd, LOCK_EX)) PFATAL("flock() failed");
+
+  if (me_busy()) {
+    flock(model_reg_fd, LOCK_UN);
+    return 0;
+  }
+
+  model_reg->me_owner = getpid();
+  me_run_num = model_reg->next_run++;
+
+  flock(model_reg_fd, LOCK_UN);
+
+  fn = alloc_printf("%s/.me_input", out_dir);
+
+  unlink(fn); /* Ignore errors. */
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, buf, len, fn);
+  close(fd);
+
+  /* The next execs that hit an unmodeled peripheral rewrite the dump while
+     me.py still reads it, so me.py gets a copy of its own. */
+
+  aup_fn   = alloc_printf("%s" PM_AUP_MODEL_SUFFIX, out_file);
+  model_fn = alloc_printf("%s/.me_model.json", out_dir);
+
+  unlink(model_fn); /* Ignore errors. */
+  copy_file(aup_fn, model_fn);
+  ck_free(aup_fn);
+
+  me_pid = fork();
+  if (me_pid < 0) PFATAL("fork() for ME failed");
+
+  if (!me_pid) {
+
+    u8 run_num_str[8];
+    char* argv[] = { me_bin, "--config", me_config, "--run-num", run_num_str,
+                     "--print-to-file", "--run-from-forkserver",
+                     "--afl-file", fn, "--model-if", model_fn, NULL };
+
+    /* QEMUs spawned by ME replay the file, and must neither read our
+       testcases nor log into our bitmap while we keep fuzzing. */
+
+    unsetenv(PM_INPUT_SHM_ENV_VAR);
+    unsetenv(PM_MODEL_REG_ENV_VAR);
+    unsetenv(SHM_ENV_VAR);
+
+    if (forksrv_pid) {
+      close(fsrv_ctl_fd);
+      close(fsrv_st_fd);
+    }
+
+    close(model_reg_fd);
+
+    /* Own process group, so me_kill() gets the QEMUs of me.py too. */
+
+    setpgid(0, 0);
+
+    snprintf(run_num_str, 8, "%u", me_run_num);
+
+    execv(me_bin, argv);
+    exit(1);
+
+  }
+
+  setpgid(me_pid, me_pid); /* Ignore errors, the child did it first. */
+
+  ck_free(fn);
+  ck_free(model_fn);
+  total_me_runs++;
+
+  return 1;
+
+}
+
+
+/* Kill the ME round in progress on the way out, and give up its ownership
+   so that other instances don't wait for it. */
+
+static void me_kill(void) {
+
+  if (!me_pid) return;
+
+  kill(-me_pid, SIGKILL);
+  waitpid(me_pid, NULL, 0);
+  me_pid = 0;
+
+  flock(model_reg_fd, LOCK_EX);
+  model_reg->me_owner = 0;
+  flock(model_reg_fd, LOCK_UN);
+
+}
+
+
+/* Drop the parked testcases that wait for the model of a failed ME round.
+   Rerunning them would only start the same round again. */
+
+static void me_drop_parked(void) {
+
+  u32 i, left = 0;
+
+  for (i = 0; i < park_cnt; i++) {
+
+    if (park_gen[i] == model_gen) {
+
+      ck_free(park_buf[i]);
+      total_park_drops++;
+
+    } else {
+
+      park_buf[left]    = park_buf[i];
+      park_len[left]    = park_len[i];
+      park_rounds[left] = park_rounds[i];
+      park_gen[left]    = park_gen[i];
+      left++;
+
+    }
+
+  }
+
+  park_cnt = left;
+
+}
+
+
+/* See if me.py is done, or wait for it. Its model is published to all the
+   instances: their fork servers switch to it before their next fork. Also
+   picks up the models published by others. */
+
+static void me_poll(u8 block) {
+
+  u8  cwd[PATH_MAX];
+  u8* path;
+  s32 st, res;
+
+  me_sync_model();
+
+  if (!me_pid) return;
+
+  res = waitpid(me_pid, &st, block ? 0 : WNOHANG);
+
+  if (res < 0) PFATAL("waitpid() for ME failed");
+  if (!res) return;
+
+  me_pid = 0;
+
+  /* me.py ran in our cwd, the registry wants paths that work anywhere. */
+
+  if (!getcwd((char*)cwd, sizeof(cwd))) PFATAL("getcwd() failed");
+
+  path = alloc_printf("%s/%u/peripheral_model.json", cwd, me_run_num);
+
+  if (strlen(path) >= PM_MODEL_PATH_MAX)
+    FATAL("After on-demand model extraction, model path is too long!");
+
+  if (flock(model_reg_fd, LOCK_EX)) PFATAL("flock() failed");
+
+  /* Publish only a model that me.py finished. The fork servers would fail
+     to load anything else and exit, so keep the generation as it is. */
+
+  if (!WIFEXITED(st) || WEXITSTATUS(st) || access((char*)path, R_OK)) {
+
+    model_reg->me_owner = 0;
+    flock(model_reg_fd, LOCK_UN);
+
+    ck_free(path);
+
+    total_me_fails++;
+    me_drop_parked();
+    return;
+
+  }
+
+  model_reg->generation++;
+  __sync_synchronize();
+  strcpy(model_reg->path, (char*)path);
+  __sync_synchronize();
+  model_reg->generation++;
+
+  model_reg->me_owner = 0;
+
+  flock(model_reg_fd, LOCK_UN);
+
+  ck_free(path);
+
+  me_sync_model();
+
+}
+
+
+/* Wait for the ME round of another instance, instead of starting ours. */
+
+static void me_wait_others(void) {
+
+  while (!stop_soon && me_busy()) usleep(100000);
+
+  me_sync_model();
+
+}
+
+
+/* Keep a testcase that hit an unmodeled peripheral until a newer model is
+   published. It will be rerun by run_parked(), or dropped if the park is
+   full or its ME round fails. */
+
+static void me_park(u8* buf, u32 len) {
+
+  if (park_cnt == PM_ME_PARK_MAX) {
+    ck_free(buf);
+    total_park_drops++;
+    return;
+  }
+
+  park_buf[park_cnt]    = buf;
+  park_len[park_cnt]    = len;
+  park_rounds[park_cnt] = me_case_rounds + 1;
+  park_gen[park_cnt]    = model_gen;
+  park_cnt++;
+
+  total_parked++;
+
+}
+
+
+/* Map the model registry, shared with the instances syncing through the
+   same directory, and export it to the fork server. A model may be out
+   already, then it replaces the one given by -c. */
+
+static void setup_model_reg(void) {
+
+  u8* fn = getenv("AFL_MODEL_REGISTRY");
+  struct stat st;
+
+  if (fn) fn = ck_strdup(fn);
+  else fn = alloc_printf("%s/model_registry", sync_id ? sync_dir : out_dir);
+
+  model_reg_fd = open(fn, O_RDWR | O_CREAT, 0600);
+  if (model_reg_fd < 0) PFATAL("Unable to open '%s'", fn);
 
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+  if (flock(model_reg_fd, LOCK_EX)) PFATAL("flock() failed");
 
-  memset(virgin_hang, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+  if (fstat(model_reg_fd, &st)) PFATAL("fstat() failed");
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  if (st.st_size < sizeof(struct pm_model_registry) &&
+      ftruncate(model_reg_fd, sizeof(struct pm_model_registry)))
+    PFATAL("ftruncate() failed");
 
-  if (shm_id < 0) PFATAL("shmget() failed");
+  model_reg = mmap(NULL, sizeof(struct pm_model_registry),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, model_reg_fd, 0);
 
-  atexit(remove_shm);
+  if (model_reg == MAP_FAILED) PFATAL("mmap() failed");
 
-  shm_str = alloc_printf("%d", shm_id);
+  /* Round 0 is the model fuzz.py extracted. */
 
-  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
-     we don't want them to detect instrumentation, since we won't be sending
-     fork server commands. This should be replaced with better auto-detection
-     later on, perhaps? */
+  if (!model_reg->next_run) model_reg->next_run = 1;
 
-  if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
+  flock(model_reg_fd, LOCK_UN);
 
-  ck_free(shm_str);
+  setenv(PM_MODEL_REG_ENV_VAR, fn, 1);
+  ck_free(fn);
 
-  trace_bits = shmat(shm_id, NULL, 0);
-  
-  if (!trace_bits) PFATAL("shmat() failed");
+  if (me_sync_model()) OKF("Using model '%s' from the registry.", model_if);
 
 }
 
@@ -1278,6 +1517,18 @@ static void setup_post(void) {
 }
 
 
+/* Pick the bitmap kernels for this CPU, unless told to stick to the
+   portable ones. */
+
+static void setup_bitmap_ops(void) {
+
+  if (!getenv("AFL_NO_SIMD")) bitmap_ops = bitmap_pick_ops();
+
+  OKF("Using %s bitmap kernels.", bitmap_ops->name);
+
+}
+
+
 /* Read all testcases from the input directory, then queue them for testing.
    Called at startup. */
 
@@ -2000,7 +2251,13 @@ EXP_ST void init_forkserver(char** argv) {
      Otherwise, try to figure out what went wrong. */
 
   if (rlen == 4) {
-    OKF("All right - fork server is up.");
+
+    /* P2IM: QEMU tells how much of the map it uses, see MAP_SIZE_MIN. */
+
+    if (status >= MAP_SIZE_MIN && status <= MAP_SIZE &&
+        !(status & (status - 1))) map_size = status;
+
+    OKF("All right - fork server is up (map size %u).", map_size);
     return;
   }
 
@@ -2147,7 +2404,7 @@ static u8 run_target(char** argv) {
 
   child_timed_out = 0;
 
-  int cur_case_me_run_num = 0;
+  int cur_case_me_run_num = me_case_rounds;
 
   /* After this memset, trace_bits[] are effectively volatile, so we
      must prevent any earlier operations from venturing into that
@@ -2156,7 +2413,7 @@ static u8 run_target(char** argv) {
   doneWork_param = 0;
 
 RERUN_AFTER_ME:
-  memset(trace_bits, 0, MAP_SIZE);
+  reset_trace();
   MEM_BARRIER();
 
   /* If we're running in "dumb" mode, we can't rely on the fork server
@@ -2303,74 +2560,53 @@ RERUN_AFTER_ME:
   if (WIFEXITED(status) && (WEXITSTATUS(status) == PM_UNCAT_REG ||
     WEXITSTATUS(status) == PM_UNMOD_SRRS)) {
     /* Fuzzer run is terminated by access to unmodeled peripheral. */
-    if (dumb_mode == 1 || no_forkserver) {
-      /* fork server is disabled, extracted model here */
-      static int run_num = 1;
-      static char run_num_str[8];
-
-      s32 me_pid;
-      int me_status;
-
-      if (cur_case_me_run_num >= MAX_ME_INVOC_PER_CASE) {
-        // limit ME invocation # per case to avoid hanging AFL
-        // if exceeds threshold, error may happens. This case raises a crash
-        status = MAX_ME_INVOC_PER_CASE_VIOLATION;
-      } else {
-      // run me.py
-      me_pid = fork();
-      if (me_pid < 0) PFATAL("fork() for ME failed");
-
-      if (!me_pid) {
-        // Child
-        snprintf(run_num_str, 8, "%d", run_num);
-        char *argv[] = {me_bin, "--config", me_config,
-            "--run-num", run_num_str, "--print-to-file",
-            "--run-from-forkserver",
-            // fuzzer run dumps access to unmodeled peri into model_if
-            "--afl-file", out_file, "--model-if", model_if, NULL};
-
-        execv(me_bin, argv);
-      } else {
-        // Parent
-        if (waitpid(me_pid, &me_status, 0) <= 0)
-          PFATAL("waitpid() for ME failed");
-
-        // update model_if
-        // no need to modify -model-input option in argv of qemu cmd
-        // it always points to model_if global buffer
-        if (snprintf(model_if, MODEL_IF_LEN, "%d/peripheral_model.json", 
-          run_num) > MODEL_IF_LEN)
-          FATAL("After on-demand model extraction, model_if is too long!");
-        run_num ++;
-        cur_case_me_run_num ++;
-
-        // rerun the fuzzer run terminated by aup
-        goto RERUN_AFTER_ME;
-      }
-      }
+    if (cur_case_me_run_num >= MAX_ME_INVOC_PER_CASE) {
+      // limit ME invocation # per case to avoid hanging AFL
+      // if exceeds threshold, error may happens. This case raises a crash
+      status = MAX_ME_INVOC_PER_CASE_VIOLATION;
     } else {
-      /* fork server is going to invoke me.py to extract the missing model.
-         Upon finish, it will send 0 through pipe. */
-      s32 res;
-
-      if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
-        if (stop_soon) return 0;
-        RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+      u32 len;
+      u8* buf = me_read_case(&len);
+
+      if (me_park_ok) {
+        // fuzzing goes on with the current model meanwhile
+        if (!me_busy()) me_start(buf, len);
+        me_park(buf, len);
+        total_execs++;
+        return FAULT_PARKED;
       }
 
-      if (status == PM_ME_EXIT) {
-        /* me.py exits. Any value other than this indicates error happens, 
-           we reuse afl's code to handle them. */
-
-        // no need to clean up local variables before goto
-        // TODO check number of ME invocation in qemu
-        goto RERUN_AFTER_ME;
-      }
+      // dry run, calibration and trimming need the result, wait for a
+      // model that may be in the works already, then for this case's, or
+      // for the one another instance is extracting
+      me_poll(1);
+      if (me_start(buf, len)) me_poll(1);
+      else me_wait_others();
+      ck_free(buf);
+      cur_case_me_run_num ++;
+
+      // rerun the fuzzer run terminated by aup
+      goto RERUN_AFTER_ME;
     }
   }
 
   total_execs++;
 
+  /* Blocks the child had to JIT itself, the fork server caches them for
+     later children. */
+
+  total_tsl += in_shm->tsl_num;
+  in_shm->tsl_num = 0;
+
+  /* Snapshot restore cost of a persistent child, zero otherwise. */
+
+  total_restore_pages += in_shm->restore_pages;
+  total_restore_ns    += in_shm->restore_ns;
+  in_shm->restore_pages = in_shm->restore_ns = 0;
+
+  total_fork_ns += in_shm->fork_ns;
+  in_shm->fork_ns = 0;
+
   /* Any subsequent operations on trace_bits must not be moved by the
      compiler below this point. Past this location, trace_bits[] behave
      very normally and do not have to be treated as volatile. */
@@ -2379,11 +2615,12 @@ RERUN_AFTER_ME:
 
   tb4 = *(u32*)trace_bits;
 
-#ifdef __x86_64__
-  classify_counts((u64*)trace_bits);
-#else
-  classify_counts((u32*)trace_bits);
-#endif /* ^__x86_64__ */
+  /* A child killed mid-exec may have bumped a slot without listing it. */
+
+  trace_listed = in_shm->edge_log && in_shm->edge_num <= PM_EDGE_LIST_MAX &&
+                 !child_timed_out && !WIFSIGNALED(status);
+
+  classify_counts(trace_bits);
 
   prev_timed_out = child_timed_out;
 
@@ -2427,6 +2664,15 @@ static void write_to_testcase(void* mem, u32 len) {
 
   s32 fd = out_fd;
 
+  in_shm->len = len;
+  in_shm->consumed = 0;
+  in_shm->key_num  = 0;
+  memcpy(in_shm->buf, mem, len);
+
+  /* QEMU reads it from SHM, skip the file. */
+
+  if (in_shm->used) return;
+
   if (out_file) {
 
     unlink(out_file); /* Ignore errors. */
@@ -2456,6 +2702,14 @@ static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
   s32 fd = out_fd;
   u32 tail_len = len - skip_at - skip_len;
 
+  in_shm->len = len - skip_len;
+  in_shm->consumed = 0;
+  in_shm->key_num  = 0;
+  memcpy(in_shm->buf, mem, skip_at);
+  memcpy(in_shm->buf + skip_at, mem + skip_at + skip_len, tail_len);
+
+  if (in_shm->used) return;
+
   if (out_file) {
 
     unlink(out_file); /* Ignore errors. */
@@ -2536,7 +2790,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
       goto abort_calibration;
     }
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     if (q->exec_cksum != cksum) {
 
@@ -2612,7 +2866,7 @@ static void check_map_coverage(void) {
 
   if (count_bytes(trace_bits) < 100) return;
 
-  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
+  for (i = map_size >> 1; i < map_size; i++)
     if (trace_bits[i]) return;
 
   WARNF("Recompile binary with newer version of afl to improve coverage!");
@@ -2829,11 +3083,19 @@ static void perform_dry_run(char** argv) {
 
 static void link_or_copy(u8* old_path, u8* new_path) {
 
-  s32 i = link(old_path, new_path);
-  s32 sfd, dfd;
-  u8* tmp;
+  if (!link(old_path, new_path)) return;
+
+  copy_file(old_path, new_path);
+
+}
 
-  if (!i) return;
+
+/* Copy a file, for when a link would see later rewrites of the original. */
+
+static void copy_file(u8* old_path, u8* new_path) {
+
+  s32 i, sfd, dfd;
+  u8* tmp;
 
   sfd = open(old_path, O_RDONLY);
   if (sfd < 0) PFATAL("Unable to open '%s'", old_path);
@@ -3078,7 +3340,7 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
       queued_with_cov++;
     }
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     /* Try to calibrate inline; this also calls update_bitmap_score() when
        successful. */
@@ -3093,6 +3355,8 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
     ck_write(fd, mem, len, fn);
     close(fd);
 
+    if (trace_dump_dir) dump_trace(queued_paths - 1);
+
     keeping = 1;
 
   }
@@ -3112,11 +3376,7 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
       if (!dumb_mode) {
 
-#ifdef __x86_64__
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^__x86_64__ */
+        simplify_trace(trace_bits);
 
         if (!has_new_bits(virgin_hang)) return keeping;
 
@@ -3151,11 +3411,7 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
       if (!dumb_mode) {
 
-#ifdef __x86_64__
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^__x86_64__ */
+        simplify_trace(trace_bits);
 
         if (!has_new_bits(virgin_crash)) return keeping;
 
@@ -3277,9 +3533,27 @@ static void find_timeout(void) {
 
 /* Update stats file for unattended monitoring. */
 
+/* Blocks translated per exec since the last call, should trend to zero as
+   the fork server caches translations. Only the fork server counts them,
+   so it stays 0 with AFL_NO_FORKSRV. */
+
+static double tsl_per_exec(u64* prev_tsl, u64* prev_execs, double* last) {
+
+  if (total_execs > *prev_execs) {
+    *last = (double)(total_tsl - *prev_tsl) / (total_execs - *prev_execs);
+    *prev_tsl   = total_tsl;
+    *prev_execs = total_execs;
+  }
+
+  return *last;
+
+}
+
+
 static void write_stats_file(double bitmap_cvg, double eps) {
 
-  static double last_bcvg, last_eps;
+  static double last_bcvg, last_eps, last_tpe;
+  static u64 prev_tsl, prev_execs;
 
   u8* fn = alloc_printf("%s/fuzzer_stats", out_dir);
   s32 fd;
@@ -3328,6 +3602,16 @@ static void write_stats_file(double bitmap_cvg, double eps) {
              "last_crash     : %llu\n"
              "last_hang      : %llu\n"
              "exec_timeout   : %u\n"
+             "tsl_per_exec   : %0.02f\n"
+             "restore_pages  : %0.02f\n"
+             "restore_us     : %0.02f\n"
+             "fork_us        : %0.02f\n"
+             "stream_havoc   : %llu/%llu\n"
+             "me_runs        : %llu\n"
+             "me_parked      : %llu\n"
+             "me_park_drops  : %llu\n"
+             "me_fails       : %llu\n"
+             "me_models      : %u\n"
              "afl_banner     : %s\n"
              "afl_version    : " VERSION "\n"
              "command_line   : %s\n",
@@ -3337,7 +3621,15 @@ static void write_stats_file(double bitmap_cvg, double eps) {
              max_depth, current_entry, pending_favored, pending_not_fuzzed,
              queued_variable, bitmap_cvg, unique_crashes, unique_hangs,
              last_path_time / 1000, last_crash_time / 1000,
-             last_hang_time / 1000, exec_tmout, use_banner, orig_cmdline);
+             last_hang_time / 1000, exec_tmout,
+             tsl_per_exec(&prev_tsl, &prev_execs, &last_tpe),
+             total_execs ? (double)total_restore_pages / total_execs : 0,
+             total_execs ? total_restore_ns / 1000.0 / total_execs : 0,
+             total_execs ? total_fork_ns / 1000.0 / total_execs : 0,
+             stage_finds[STAGE_STREAM], stage_cycles[STAGE_STREAM],
+             total_me_runs, total_parked, total_park_drops, total_me_fails,
+             model_gen >> 1,
+             use_banner, orig_cmdline);
              /* ignore errors */
 
   fclose(f);
@@ -3350,7 +3642,8 @@ static void write_stats_file(double bitmap_cvg, double eps) {
 static void maybe_update_plot_file(double bitmap_cvg, double eps) {
 
   static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
-  static u64 prev_qc, prev_uc, prev_uh;
+  static u64 prev_qc, prev_uc, prev_uh, prev_tsl, prev_execs;
+  static double last_tpe;
 
   if (prev_qp == queued_paths && prev_pf == pending_favored && 
       prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
@@ -3370,13 +3663,15 @@ static void maybe_update_plot_file(double bitmap_cvg, double eps) {
 
      unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
      favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
-     execs_per_sec */
+     execs_per_sec, tsl_per_exec */
 
   fprintf(plot_file, 
-          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f\n",
+          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f, "
+          "%0.02f\n",
           get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
           pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
-          unique_hangs, max_depth, eps); /* ignore errors */
+          unique_hangs, max_depth, eps,
+          tsl_per_exec(&prev_tsl, &prev_execs, &last_tpe)); /* ignore errors */
 
   fflush(plot_file);
 
@@ -3728,6 +4023,14 @@ static void maybe_delete_out_dir(void) {
   if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
   ck_free(fn);
 
+  /* Models published by the previous session, kept on in-place resume. */
+
+  if (!in_place_resume) {
+    fn = alloc_printf("%s/model_registry", out_dir);
+    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+    ck_free(fn);
+  }
+
   OKF("Output dir cleanup successful.");
 
   /* Wow... is that all? If yes, celebrate! */
@@ -3811,7 +4114,7 @@ static void show_stats(void) {
   /* Do some bitmap stats. */
 
   t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+  t_byte_ratio = ((double)t_bytes * 100) / map_size;
 
   /* Roughly every minute, update fuzzer stats and save auto tokens. */
 
@@ -3844,7 +4147,7 @@ static void show_stats(void) {
 
   /* Compute some mildly useful bitmap stats. */
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+  t_bits = (map_size << 3) - count_bits(virgin_bits);
 
   /* Now, for the visuals... */
 
@@ -4119,9 +4422,10 @@ static void show_stats(void) {
        "  imported : " cRST "%-10s " bSTG bV "\n", tmp,
        sync_id ? DI(queued_imported) : (u8*)"n/a");
 
-  sprintf(tmp, "%s/%s, %s/%s",
+  sprintf(tmp, "%s/%s, %s/%s, %s/%s",
           DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
-          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
+          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]),
+          DI(stage_finds[STAGE_STREAM]), DI(stage_cycles[STAGE_STREAM]));
 
   SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP 
        "  variable : %s%-10s " bSTG bV "\n", tmp, queued_variable ? cLRD : cRST,
@@ -4327,6 +4631,36 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
   stage_name = tmp;
   bytes_trim_in += q->len;
 
+  /* Bytes past what DR reads consumed are never seen by the firmware, so
+     drop them first. QEMU reports the consumed length only through SHM. */
+
+  if (in_shm->used) {
+
+    sprintf(tmp, "trim tail");
+
+    write_to_testcase(in_buf, q->len);
+
+    fault = run_target(argv);
+    trim_execs++;
+
+    if (stop_soon || fault == FAULT_ERROR) goto abort_trimming;
+
+    if (in_shm->consumed < q->len &&
+        hash32(trace_bits, map_size, HASH_CONST) == q->exec_cksum) {
+
+      /* QEMU rejects empty input. */
+
+      q->len = MAX(in_shm->consumed, 1);
+
+      needs_write = 1;
+      memcpy(clean_trace, trace_bits, map_size);
+
+      if (q->len < 5) goto trim_done;
+
+    }
+
+  }
+
   /* Select initial chunk len, starting with large steps. */
 
   len_p2 = next_p2(q->len);
@@ -4359,7 +4693,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
       /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       /* If the deletion had no impact on the trace, make it permanent. This
          isn't perfect for variable-path inputs, but we're just making a
@@ -4382,7 +4716,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
         if (!needs_write) {
 
           needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+          memcpy(clean_trace, trace_bits, map_size);
 
         }
 
@@ -4399,6 +4733,8 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   }
 
+trim_done:
+
   /* If we have made changes to in_buf, we also need to update the on-disk
      version of the test case. */
 
@@ -4415,7 +4751,8 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
     ck_write(fd, in_buf, q->len, q->fname);
     close(fd);
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    memcpy(trace_bits, clean_trace, map_size);
+    trace_listed = 0;
     update_bitmap_score(q);
 
   }
@@ -4445,9 +4782,13 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
   }
 
+  me_poll(0);
+
   write_to_testcase(out_buf, len);
 
+  me_park_ok = 1;
   fault = run_target(argv);
+  me_park_ok = 0;
 
   if (stop_soon) return 1;
 
@@ -4773,6 +5114,172 @@ static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
 }
 
 
+/* P2IM: per DR register input streams, see peri-mod.h for the format. */
+
+struct pm_stream {
+  u32 key;                            /* DR register address, 0: default  */
+  u32 len;
+  u8* data;
+};
+
+/* Split testcase into streams, st[0] being the default one. Returns the
+   number of streams. Mirrors pm_input_parse() in QEMU. */
+
+static u32 pm_parse_streams(u8* buf, u32 len, struct pm_stream* st) {
+
+  u32 magic_len = strlen(PM_INPUT_STREAM_MAGIC), st_num = 1;
+  u8* end = buf + len;
+
+  memset(st, 0, sizeof(struct pm_stream) * (PM_INPUT_MAX_STREAMS + 1));
+  st[0].data = buf;
+
+  if (len < magic_len || memcmp(buf, PM_INPUT_STREAM_MAGIC, magic_len)) {
+    st[0].len = len;
+    return 1;
+  }
+
+  buf += magic_len;
+
+  while (end - buf >= 8) {
+
+    struct pm_stream* s = NULL;
+    u32 key = *(u32*)buf, s_len = *(u32*)(buf + 4);
+
+    buf += 8;
+    if (s_len > end - buf) s_len = end - buf;
+
+    if (!key) s = &st[0];
+    else if (st_num <= PM_INPUT_MAX_STREAMS) s = &st[st_num++];
+
+    if (s) {
+      s->key  = key;
+      s->len  = s_len;
+      s->data = buf;
+    }
+
+    buf += s_len;
+
+  }
+
+  return st_num;
+
+}
+
+
+/* Serialize streams into out, returns its length or 0 if over MAX_FILE. */
+
+static u32 pm_pack_streams(struct pm_stream* st, u32 st_num, u8* out) {
+
+  u32 magic_len = strlen(PM_INPUT_STREAM_MAGIC), len = magic_len, i;
+
+  for (i = 0; i < st_num; i++) len += 8 + st[i].len;
+  if (len > MAX_FILE) return 0;
+
+  memcpy(out, PM_INPUT_STREAM_MAGIC, magic_len);
+  out += magic_len;
+
+  for (i = 0; i < st_num; i++) {
+
+    *(u32*)out = st[i].key;
+    *(u32*)(out + 4) = st[i].len;
+    memcpy(out + 8, st[i].data, st[i].len);
+    out += 8 + st[i].len;
+
+  }
+
+  return len;
+
+}
+
+
+/* Stacked havoc tweaks on a single stream in buf, which has room for cap
+   bytes. Returns the new length. */
+
+static u32 pm_mutate_stream(u8* buf, u32 len, u32 cap) {
+
+  u32 use_stacking = 1 << (1 + UR(HAVOC_STACK_POW2)), i;
+
+  for (i = 0; i < use_stacking; i++) {
+
+    /* Empty streams can only grow. */
+
+    switch (len ? UR(7) : 6) {
+
+      case 0:
+
+        buf[UR(len)] ^= 1 << UR(8);
+        break;
+
+      case 1:
+
+        buf[UR(len)] = interesting_8[UR(sizeof(interesting_8))];
+        break;
+
+      case 2:
+
+        buf[UR(len)] -= 1 + UR(ARITH_MAX);
+        break;
+
+      case 3:
+
+        buf[UR(len)] += 1 + UR(ARITH_MAX);
+        break;
+
+      case 4:
+
+        buf[UR(len)] ^= 1 + UR(255);
+        break;
+
+      case 5: {
+
+          /* Delete bytes. */
+
+          u32 del_from, del_len;
+
+          if (len < 2) break;
+
+          del_len  = choose_block_len(len - 1);
+          del_from = UR(len - del_len + 1);
+
+          memmove(buf + del_from, buf + del_from + del_len,
+                  len - del_from - del_len);
+
+          len -= del_len;
+          break;
+
+        }
+
+      case 6: {
+
+          /* Insert a block of random or constant bytes. */
+
+          u32 ins_len = choose_block_len(HAVOC_BLK_SMALL), k;
+          u32 ins_at  = UR(len + 1);
+
+          if (len + ins_len > cap) break;
+
+          memmove(buf + ins_at + ins_len, buf + ins_at, len - ins_at);
+
+          if (UR(2)) {
+
+            for (k = 0; k < ins_len; k++) buf[ins_at + k] = UR(256);
+
+          } else memset(buf + ins_at, UR(256), ins_len);
+
+          len += ins_len;
+          break;
+
+        }
+
+    }
+
+  }
+
+  return len;
+
+}
+
+
 /* Take the current entry from the queue, fuzz it for a while. This
    function is a tad too long... returns 0 if fuzzed successfully, 1 if
    skipped or bailed out. */
@@ -4978,7 +5485,7 @@ static u8 fuzz_one(char** argv) {
 
     if (!dumb_mode && (stage_cur & 7) == 7) {
 
-      u32 cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      u32 cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       if (stage_cur == stage_max - 1 && cksum == prev_cksum) {
 
@@ -5136,7 +5643,7 @@ static u8 fuzz_one(char** argv) {
          without wasting time on checksums. */
 
       if (!dumb_mode && len >= EFF_MIN_LEN)
-        cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+        cksum = hash32(trace_bits, map_size, HASH_CONST);
       else
         cksum = ~queue_cur->exec_cksum;
 
@@ -5875,6 +6382,104 @@ havoc_stage:
 
   stage_cur_byte = -1;
 
+  /****************
+   * STREAM HAVOC *
+   ****************/
+
+  /* P2IM: mutate the input stream of one DR register at a time, so that
+     the bytes fed to the other registers stay where they are. Streams are
+     discovered by running the entry once and collecting the DR registers
+     QEMU reports. Only the streams of those registers are mutated, and it
+     takes two of them: a single register reading a copy of the default
+     stream is what plain havoc does already. Not done when splicing. */
+
+  if (!splice_cycle && in_shm->used) {
+
+    struct pm_stream st[PM_INPUT_MAX_STREAMS + 1];
+    u32 st_num = pm_parse_streams(in_buf, len, st), k;
+    u32 live[PM_INPUT_MAX_STREAMS], live_num = 0;
+    u8 *st_buf, *pk_buf;
+
+    write_to_testcase(in_buf, len);
+    run_target(argv);
+
+    if (stop_soon) goto abandon_entry;
+
+    /* Registers without their own stream start off with a copy of the
+       default one, which is what they have been reading so far. */
+
+    for (k = 0; k < in_shm->key_num && k < PM_INPUT_MAX_STREAMS; k++) {
+
+      u32 n;
+
+      for (n = 1; n < st_num; n++)
+        if (st[n].key == in_shm->keys[k]) break;
+
+      if (n == st_num) {
+
+        if (st_num > PM_INPUT_MAX_STREAMS) break;
+
+        st[st_num].key  = in_shm->keys[k];
+        st[st_num].len  = st[0].len;
+        st[st_num].data = st[0].data;
+        st_num++;
+
+      }
+
+      live[live_num++] = n;
+
+    }
+
+    if (live_num > 1) {
+
+      st_buf = ck_alloc_nozero(MAX_FILE);
+      pk_buf = ck_alloc_nozero(MAX_FILE);
+
+      stage_name  = "stream havoc";
+      stage_short = "stream";
+      stage_max   = live_num * PM_STREAM_CYCLES * perf_score / havoc_div / 100;
+
+      if (stage_max < HAVOC_MIN) stage_max = HAVOC_MIN;
+
+      orig_hit_cnt = queued_paths + unique_crashes;
+
+      for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+
+        struct pm_stream orig;
+        u32 n = live[stage_cur % live_num], pk_len;
+
+        orig = st[n];
+        stage_cur_val = n;
+
+        memcpy(st_buf, orig.data, orig.len);
+        st[n].len  = pm_mutate_stream(st_buf, orig.len, MAX_FILE / 2);
+        st[n].data = st_buf;
+
+        pk_len = pm_pack_streams(st, st_num, pk_buf);
+        st[n]  = orig;
+
+        if (!pk_len) continue;
+
+        if (common_fuzz_stuff(argv, pk_buf, pk_len)) {
+          ck_free(st_buf);
+          ck_free(pk_buf);
+          goto abandon_entry;
+        }
+
+      }
+
+      ck_free(st_buf);
+      ck_free(pk_buf);
+
+      new_hit_cnt = queued_paths + unique_crashes;
+
+      stage_finds[STAGE_STREAM]  += new_hit_cnt - orig_hit_cnt;
+      stage_cycles[STAGE_STREAM] += stage_max;
+
+    }
+
+  }
+
   /* The havoc stage mutation code is also invoked when splicing files; if the
      splice_cycle variable is set, generate different descriptions and such. */
 
@@ -6432,6 +7037,70 @@ abandon_entry:
 }
 
 
+/* Rerun parked testcases once a newer model is published, see me_park(). */
+
+static void run_parked(char** argv) {
+
+  u8* buf[PM_ME_PARK_MAX];
+  u32 len[PM_ME_PARK_MAX], rounds[PM_ME_PARK_MAX];
+  u32 i, n = 0, left = 0;
+  u8  idle;
+
+  me_poll(0);
+
+  /* Take out the cases that have a newer model, common_fuzz_stuff() may
+     park some of them again. If no ME round is running anywhere, e.g. the
+     instance that ran one died, rerun them all to get one going. */
+
+  idle = !me_busy();
+
+  for (i = 0; i < park_cnt; i++) {
+
+    if (idle || park_gen[i] != model_gen) {
+
+      buf[n]    = park_buf[i];
+      len[n]    = park_len[i];
+      rounds[n] = park_rounds[i];
+      n++;
+
+    } else {
+
+      park_buf[left]    = park_buf[i];
+      park_len[left]    = park_len[i];
+      park_rounds[left] = park_rounds[i];
+      park_gen[left]    = park_gen[i];
+      left++;
+
+    }
+
+  }
+
+  park_cnt = left;
+
+  if (!n) return;
+
+  stage_name  = "me rerun";
+  stage_short = "merun";
+  stage_cur   = 0;
+  stage_max   = n;
+
+  for (i = 0; i < n; i++) {
+
+    if (!stop_soon) {
+      me_case_rounds = rounds[i];
+      common_fuzz_stuff(argv, buf[i], len[i]);
+      stage_cur++;
+    }
+
+    ck_free(buf[i]);
+
+  }
+
+  me_case_rounds = 0;
+
+}
+
+
 /* Grab interesting test cases from other fuzzers. */
 
 static void sync_fuzzers(char** argv) {
@@ -6572,6 +7241,7 @@ static void handle_stop_sig(int sig) {
 
   if (child_pid > 0) kill(child_pid, SIGKILL);
   if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+  if (me_pid > 0) kill(-me_pid, SIGKILL);
 
 }
 
@@ -6995,7 +7665,8 @@ EXP_ST void setup_dirs_fds(void) {
 
   fprintf(plot_file, "# unix_time, cycles_done, cur_path, paths_total, "
                      "pending_total, pending_favs, map_size, unique_crashes, "
-                     "unique_hangs, max_depth, execs_per_sec\n");
+                     "unique_hangs, max_depth, execs_per_sec, "
+                     "tsl_per_exec\n");
                      /* ignore errors */
 
 }
@@ -7722,6 +8393,8 @@ int main(int argc, char** argv) {
   if (getenv("AFL_NO_VAR_CHECK"))  no_var_check     = 1;
   if (getenv("AFL_SHUFFLE_QUEUE")) shuffle_queue    = 1;
 
+  trace_dump_dir = getenv("AFL_DUMP_TRACES");
+
   if (dumb_mode == 2 && no_forkserver)
     FATAL("AFL_DUMB_FORKSRV and AFL_NO_FORKSRV are mutually exclusive");
 
@@ -7743,9 +8416,11 @@ int main(int argc, char** argv) {
   check_cpu_governor();
 
   setup_post();
+  setup_bitmap_ops();
   setup_shm();
 
   setup_dirs_fds();
+  setup_model_reg();
   read_testcases();
   load_auto();
 
@@ -7833,6 +8508,8 @@ int main(int argc, char** argv) {
 
     skipped_fuzz = fuzz_one(use_argv);
 
+    if (!stop_soon && park_cnt) run_parked(use_argv);
+
     if (!stop_soon && sync_id && !skipped_fuzz) {
       
       if (!(sync_interval_cnt++ % SYNC_INTERVAL))
@@ -7857,6 +8534,8 @@ int main(int argc, char** argv) {
 
 stop_fuzzing:
 
+  me_kill();
+
   SAYF(CURSOR_SHOW cLRD "\n\n+++ Testing aborted %s +++\n" cRST,
        stop_soon == 2 ? "programatically" : "by user");
 
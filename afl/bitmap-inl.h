@@ -0,0 +1,616 @@
+/*
+   american fuzzy lop - trace bitmap kernels
+   -----------------------------------------
+
+   The per-exec and per-status-screen passes over the trace bitmap:
+   classification of hit counts, novelty detection against the virgin maps,
+   and the various counters. Each kernel comes in a scalar flavor (the
+   original afl-fuzz code) and, on x86_64 with GCC or clang, in SSE4.2 and
+   AVX2 flavors. bitmap_pick_ops() chooses the widest one the CPU supports.
+
+   All kernels take the map length in bytes; it must be a multiple of 32.
+
+ */
+
+#ifndef _HAVE_BITMAP_INL_H
+#define _HAVE_BITMAP_INL_H
+
+#include "types.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define BITMAP_SIMD
+#  include <immintrin.h>
+#endif /* __x86_64__ && __GNUC__ */
+
+/* A set of kernels for one instruction set. */
+
+struct bitmap_ops {
+
+  const char* name;
+
+  u8  (*has_new_bits)(u8* trace, u8* virgin, u32 len);
+  void (*classify_counts)(u8* mem, u32 len);
+  void (*simplify_trace)(u8* mem, u32 len);
+  void (*minimize_bits)(u8* dst, u8* src, u32 len);
+  u32 (*count_bits)(u8* mem, u32 len);
+  u32 (*count_bytes)(u8* mem, u32 len);
+  u32 (*count_non_255_bytes)(u8* mem, u32 len);
+
+};
+
+
+/* Lookup tables for the scalar kernels. simplify_trace() turns hit counts
+   into 0x80 (hit) or 0x01 (not hit); classify_counts() buckets them into
+   powers of two. */
+
+#define AREP4(_sym)   (_sym), (_sym), (_sym), (_sym)
+#define AREP8(_sym)   AREP4(_sym), AREP4(_sym)
+#define AREP16(_sym)  AREP8(_sym), AREP8(_sym)
+#define AREP32(_sym)  AREP16(_sym), AREP16(_sym)
+#define AREP64(_sym)  AREP32(_sym), AREP32(_sym)
+#define AREP128(_sym) AREP64(_sym), AREP64(_sym)
+
+static u8 simplify_lookup[256] = {
+  /*    4 */ 1, 128, 128, 128,
+  /*   +4 */ AREP4(128),
+  /*   +8 */ AREP8(128),
+  /*  +16 */ AREP16(128),
+  /*  +32 */ AREP32(128),
+  /*  +64 */ AREP64(128),
+  /* +128 */ AREP128(128)
+};
+
+static u8 count_class_lookup[256] = {
+
+  /* 0 - 3:       4 */ 0, 1, 2, 4,
+  /* 4 - 7:      +4 */ AREP4(8),
+  /* 8 - 15:     +8 */ AREP8(16),
+  /* 16 - 31:   +16 */ AREP16(32),
+  /* 32 - 127:  +96 */ AREP64(64), AREP32(64),
+  /* 128+:     +128 */ AREP128(128)
+
+};
+
+
+/* Check if the trace brings anything new compared to the virgin map, and
+   clear the bits it covers from the latter. Returns 1 if the only change is
+   the hit-count for a particular tuple; 2 if there are new tuples seen. */
+
+#define FFL(_b) (0xffULL << ((_b) << 3))
+#define FF(_b)  (0xff << ((_b) << 3))
+
+static u8 has_new_bits_scalar(u8* trace, u8* virgin_map, u32 len) {
+
+#ifdef __x86_64__
+
+  u64* current = (u64*)trace;
+  u64* virgin  = (u64*)virgin_map;
+
+  u32  i = (len >> 3);
+
+#else
+
+  u32* current = (u32*)trace;
+  u32* virgin  = (u32*)virgin_map;
+
+  u32  i = (len >> 2);
+
+#endif /* ^__x86_64__ */
+
+  u8   ret = 0;
+
+  while (i--) {
+
+#ifdef __x86_64__
+
+    u64 cur = *current;
+    u64 vir = *virgin;
+
+#else
+
+    u32 cur = *current;
+    u32 vir = *virgin;
+
+#endif /* ^__x86_64__ */
+
+    /* Optimize for *current == ~*virgin, since this will almost always be the
+       case. */
+
+    if (cur & vir) {
+
+      if (ret < 2) {
+
+        /* This trace did not have any new bytes yet; see if there's any
+           current[] byte that is non-zero when virgin[] is 0xff. */
+
+#ifdef __x86_64__
+
+        if (((cur & FFL(0)) && (vir & FFL(0)) == FFL(0)) ||
+            ((cur & FFL(1)) && (vir & FFL(1)) == FFL(1)) ||
+            ((cur & FFL(2)) && (vir & FFL(2)) == FFL(2)) ||
+            ((cur & FFL(3)) && (vir & FFL(3)) == FFL(3)) ||
+            ((cur & FFL(4)) && (vir & FFL(4)) == FFL(4)) ||
+            ((cur & FFL(5)) && (vir & FFL(5)) == FFL(5)) ||
+            ((cur & FFL(6)) && (vir & FFL(6)) == FFL(6)) ||
+            ((cur & FFL(7)) && (vir & FFL(7)) == FFL(7))) ret = 2;
+        else ret = 1;
+
+#else
+
+        if (((cur & FF(0)) && (vir & FF(0)) == FF(0)) ||
+            ((cur & FF(1)) && (vir & FF(1)) == FF(1)) ||
+            ((cur & FF(2)) && (vir & FF(2)) == FF(2)) ||
+            ((cur & FF(3)) && (vir & FF(3)) == FF(3))) ret = 2;
+        else ret = 1;
+
+#endif /* ^__x86_64__ */
+
+      }
+
+      *virgin = vir & ~cur;
+
+    }
+
+    current++;
+    virgin++;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Destructively classify execution counts in a trace. */
+
+static void classify_counts_scalar(u8* trace, u32 len) {
+
+#ifdef __x86_64__
+
+  u64* mem = (u64*)trace;
+  u32  i   = len >> 3;
+
+#else
+
+  u32* mem = (u32*)trace;
+  u32  i   = len >> 2;
+
+#endif /* ^__x86_64__ */
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (*mem) {
+
+      u8* mem8 = (u8*)mem;
+
+      mem8[0] = count_class_lookup[mem8[0]];
+      mem8[1] = count_class_lookup[mem8[1]];
+      mem8[2] = count_class_lookup[mem8[2]];
+      mem8[3] = count_class_lookup[mem8[3]];
+
+#ifdef __x86_64__
+
+      mem8[4] = count_class_lookup[mem8[4]];
+      mem8[5] = count_class_lookup[mem8[5]];
+      mem8[6] = count_class_lookup[mem8[6]];
+      mem8[7] = count_class_lookup[mem8[7]];
+
+#endif /* __x86_64__ */
+
+    }
+
+    mem++;
+
+  }
+
+}
+
+
+/* Destructively simplify trace by eliminating hit count information. */
+
+static void simplify_trace_scalar(u8* trace, u32 len) {
+
+#ifdef __x86_64__
+
+  u64* mem = (u64*)trace;
+  u32  i   = len >> 3;
+
+#else
+
+  u32* mem = (u32*)trace;
+  u32  i   = len >> 2;
+
+#endif /* ^__x86_64__ */
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (*mem) {
+
+      u8* mem8 = (u8*)mem;
+
+      mem8[0] = simplify_lookup[mem8[0]];
+      mem8[1] = simplify_lookup[mem8[1]];
+      mem8[2] = simplify_lookup[mem8[2]];
+      mem8[3] = simplify_lookup[mem8[3]];
+
+#ifdef __x86_64__
+
+      mem8[4] = simplify_lookup[mem8[4]];
+      mem8[5] = simplify_lookup[mem8[5]];
+      mem8[6] = simplify_lookup[mem8[6]];
+      mem8[7] = simplify_lookup[mem8[7]];
+
+    } else *mem = 0x0101010101010101ULL;
+
+#else
+
+    } else *mem = 0x01010101;
+
+#endif /* ^__x86_64__ */
+
+    mem++;
+
+  }
+
+}
+
+
+/* Compact trace bytes into a bitmap with one bit per tuple, OR-ing into
+   whatever dst already holds. */
+
+static void minimize_bits_scalar(u8* dst, u8* src, u32 len) {
+
+  u32 i = 0;
+
+  while (i < len) {
+
+    if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
+    i++;
+
+  }
+
+}
+
+
+/* Count the number of bits set in the provided bitmap. */
+
+static u32 count_bits_scalar(u8* mem, u32 len) {
+
+  u32* ptr = (u32*)mem;
+  u32  i   = (len >> 2);
+  u32  ret = 0;
+
+  while (i--) {
+
+    u32 v = *(ptr++);
+
+    /* This gets called on the inverse, virgin bitmap; optimize for sparse
+       data. */
+
+    if (v == 0xffffffff) {
+      ret += 32;
+      continue;
+    }
+
+    v -= ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    ret += (((v + (v >> 4)) & 0xF0F0F0F) * 0x01010101) >> 24;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Count the number of bytes set in the bitmap. */
+
+static u32 count_bytes_scalar(u8* mem, u32 len) {
+
+  u32* ptr = (u32*)mem;
+  u32  i   = (len >> 2);
+  u32  ret = 0;
+
+  while (i--) {
+
+    u32 v = *(ptr++);
+
+    if (!v) continue;
+    if (v & FF(0)) ret++;
+    if (v & FF(1)) ret++;
+    if (v & FF(2)) ret++;
+    if (v & FF(3)) ret++;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Count the number of non-255 bytes set in the bitmap. */
+
+static u32 count_non_255_bytes_scalar(u8* mem, u32 len) {
+
+  u32* ptr = (u32*)mem;
+  u32  i   = (len >> 2);
+  u32  ret = 0;
+
+  while (i--) {
+
+    u32 v = *(ptr++);
+
+    /* This is called on the virgin bitmap, so optimize for the most likely
+       case. */
+
+    if (v == 0xffffffff) continue;
+    if ((v & FF(0)) != FF(0)) ret++;
+    if ((v & FF(1)) != FF(1)) ret++;
+    if ((v & FF(2)) != FF(2)) ret++;
+    if ((v & FF(3)) != FF(3)) ret++;
+
+  }
+
+  return ret;
+
+}
+
+static const struct bitmap_ops bitmap_scalar = {
+
+  "scalar",
+  has_new_bits_scalar,
+  classify_counts_scalar,
+  simplify_trace_scalar,
+  minimize_bits_scalar,
+  count_bits_scalar,
+  count_bytes_scalar,
+  count_non_255_bytes_scalar
+
+};
+
+
+#ifdef BITMAP_SIMD
+
+/* The vector kernels below are written once as macros over the vector width
+   and instantiated for SSE4.2 (16 bytes, ptest + pshufb) and AVX2 (32
+   bytes). None of the maps are guaranteed to be vector-aligned, so all loads
+   and stores are unaligned. Traces are sparse, so every kernel that can tests
+   a whole vector for zero and skips it before doing any real work.
+
+   Hit count classes are computed without a 256-entry table: for counts
+   below 16 the class comes from a pshufb on the low nibble, otherwise from a
+   pshufb on the high nibble. */
+
+#define BM_CLASS_LO  0, 1, 2, 4, 8, 8, 8, 8, \
+                     16, 16, 16, 16, 16, 16, 16, 16
+#define BM_CLASS_HI  0, 32, 64, 64, 64, 64, 64, 64, \
+                     -128, -128, -128, -128, -128, -128, -128, -128
+
+#define BM_DEFINE_KERNELS(_isa, _target, _vt, _w, _pfx, _load, _store,     \
+                          _testz, _movemask, _lut)                         \
+                                                                           \
+__attribute__((target(_target)))                                           \
+static u8 has_new_bits_##_isa(u8* trace, u8* virgin, u32 len) {            \
+                                                                           \
+  _vt ff = _pfx##_set1_epi8(-1), zero = _pfx##_setzero_si##_w();           \
+  u8  ret = 0;                                                             \
+  u32 i;                                                                   \
+                                                                           \
+  for (i = 0; i < len; i += sizeof(_vt)) {                                 \
+                                                                           \
+    _vt cur = _load((_vt*)(trace + i));                                    \
+    _vt vir = _load((_vt*)(virgin + i));                                   \
+                                                                           \
+    if (_testz(cur, vir)) continue;                                        \
+                                                                           \
+    if (ret < 2) {                                                         \
+                                                                           \
+      /* Any byte that is hit now and still 0xff in virgin is new. */      \
+                                                                           \
+      _vt none = _pfx##_cmpeq_epi8(cur, zero);                             \
+      _vt new  = _pfx##_andnot_si##_w(none, _pfx##_cmpeq_epi8(vir, ff));   \
+                                                                           \
+      ret = _movemask(new) ? 2 : 1;                                        \
+                                                                           \
+    }                                                                      \
+                                                                           \
+    _store((_vt*)(virgin + i), _pfx##_andnot_si##_w(cur, vir));            \
+                                                                           \
+  }                                                                        \
+                                                                           \
+  return ret;                                                              \
+                                                                           \
+}                                                                          \
+                                                                           \
+__attribute__((target(_target)))                                           \
+static void classify_counts_##_isa(u8* mem, u32 len) {                     \
+                                                                           \
+  _vt lo_lut = _lut(BM_CLASS_LO);                           \
+  _vt hi_lut = _lut(BM_CLASS_HI);                                          \
+  _vt nib    = _pfx##_set1_epi8(0x0f), zero = _pfx##_setzero_si##_w();     \
+  u32 i;                                                                   \
+                                                                           \
+  for (i = 0; i < len; i += sizeof(_vt)) {                                 \
+                                                                           \
+    _vt v = _load((_vt*)(mem + i)), hi, lo, small;                         \
+                                                                           \
+    if (_testz(v, v)) continue;                                            \
+                                                                           \
+    hi    = _pfx##_and_si##_w(_pfx##_srli_epi16(v, 4), nib);               \
+    small = _pfx##_cmpeq_epi8(hi, zero);                                   \
+    lo    = _pfx##_shuffle_epi8(lo_lut, _pfx##_and_si##_w(v, nib));        \
+    hi    = _pfx##_shuffle_epi8(hi_lut, hi);                               \
+                                                                           \
+    _store((_vt*)(mem + i),                                                \
+           _pfx##_or_si##_w(hi, _pfx##_and_si##_w(lo, small)));            \
+                                                                           \
+  }                                                                        \
+                                                                           \
+}                                                                          \
+                                                                           \
+__attribute__((target(_target)))                                           \
+static void simplify_trace_##_isa(u8* mem, u32 len) {                      \
+                                                                           \
+  _vt one  = _pfx##_set1_epi8(0x01), hit = _pfx##_set1_epi8(-128);         \
+  _vt zero = _pfx##_setzero_si##_w();                                      \
+  u32 i;                                                                   \
+                                                                           \
+  for (i = 0; i < len; i += sizeof(_vt)) {                                 \
+                                                                           \
+    _vt none = _pfx##_cmpeq_epi8(_load((_vt*)(mem + i)), zero);            \
+                                                                           \
+    _store((_vt*)(mem + i),                                                \
+           _pfx##_or_si##_w(_pfx##_and_si##_w(none, one),                  \
+                            _pfx##_andnot_si##_w(none, hit)));             \
+                                                                           \
+  }                                                                        \
+                                                                           \
+}                                                                          \
+                                                                           \
+__attribute__((target(_target)))                                           \
+static void minimize_bits_##_isa(u8* dst, u8* src, u32 len) {              \
+                                                                           \
+  _vt zero = _pfx##_setzero_si##_w();                                      \
+  u32 i;                                                                   \
+                                                                           \
+  for (i = 0; i < len; i += sizeof(_vt)) {                                 \
+                                                                           \
+    _vt v = _load((_vt*)(src + i));                                        \
+    u32 m;                                                                 \
+                                                                           \
+    if (_testz(v, v)) continue;                                            \
+                                                                           \
+    m = ~(u32)_movemask(_pfx##_cmpeq_epi8(v, zero));                       \
+                                                                           \
+    if (sizeof(_vt) == 16) *(u16*)(dst + (i >> 3)) |= (u16)m;              \
+    else *(u32*)(dst + (i >> 3)) |= m;                                     \
+                                                                           \
+  }                                                                        \
+                                                                           \
+}                                                                          \
+                                                                           \
+__attribute__((target(_target)))                                           \
+static u32 count_bytes_##_isa(u8* mem, u32 len) {                          \
+                                                                           \
+  _vt zero = _pfx##_setzero_si##_w();                                      \
+  u32 i, ret = 0;                                                          \
+                                                                           \
+  for (i = 0; i < len; i += sizeof(_vt)) {                                 \
+                                                                           \
+    _vt v = _load((_vt*)(mem + i));                                        \
+                                                                           \
+    if (_testz(v, v)) continue;                                            \
+                                                                           \
+    ret += sizeof(_vt) -                                                   \
+           _mm_popcnt_u32(_movemask(_pfx##_cmpeq_epi8(v, zero)));          \
+                                                                           \
+  }                                                                        \
+                                                                           \
+  return ret;                                                              \
+                                                                           \
+}                                                                          \
+                                                                           \
+__attribute__((target(_target)))                                           \
+static u32 count_non_255_bytes_##_isa(u8* mem, u32 len) {                  \
+                                                                           \
+  _vt ff = _pfx##_set1_epi8(-1);                                           \
+  u32 i, ret = 0;                                                          \
+                                                                           \
+  for (i = 0; i < len; i += sizeof(_vt)) {                                 \
+                                                                           \
+    u32 m = _movemask(_pfx##_cmpeq_epi8(_load((_vt*)(mem + i)), ff));      \
+                                                                           \
+    ret += sizeof(_vt) - _mm_popcnt_u32(m);                                \
+                                                                           \
+  }                                                                        \
+                                                                           \
+  return ret;                                                              \
+                                                                           \
+}
+
+#define BM_LUT128(...) _mm_setr_epi8(__VA_ARGS__)
+#define BM_LUT256(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+#define BM_MOVEMASK128(_v) ((u32)_mm_movemask_epi8(_v))
+#define BM_MOVEMASK256(_v) ((u32)_mm256_movemask_epi8(_v))
+
+BM_DEFINE_KERNELS(sse42, "sse4.2,popcnt", __m128i, 128, _mm,
+                  _mm_loadu_si128, _mm_storeu_si128, _mm_testz_si128,
+                  BM_MOVEMASK128, BM_LUT128)
+
+BM_DEFINE_KERNELS(avx2, "avx2,popcnt", __m256i, 256, _mm256,
+                  _mm256_loadu_si256, _mm256_storeu_si256,
+                  _mm256_testz_si256,
+                  BM_MOVEMASK256, BM_LUT256)
+
+
+/* Bit counting has no use for wide vectors; the popcnt instruction that
+   comes with SSE4.2 already does 64 bits per cycle. Both SIMD flavors use
+   this one. */
+
+__attribute__((target("popcnt")))
+static u32 count_bits_popcnt(u8* mem, u32 len) {
+
+  u64* ptr = (u64*)mem;
+  u32  i   = len >> 3;
+  u32  ret = 0;
+
+  while (i--) ret += _mm_popcnt_u64(*(ptr++));
+
+  return ret;
+
+}
+
+static const struct bitmap_ops bitmap_sse42 = {
+
+  "sse4.2",
+  has_new_bits_sse42,
+  classify_counts_sse42,
+  simplify_trace_sse42,
+  minimize_bits_sse42,
+  count_bits_popcnt,
+  count_bytes_sse42,
+  count_non_255_bytes_sse42
+
+};
+
+static const struct bitmap_ops bitmap_avx2 = {
+
+  "avx2",
+  has_new_bits_avx2,
+  classify_counts_avx2,
+  simplify_trace_avx2,
+  minimize_bits_avx2,
+  count_bits_popcnt,
+  count_bytes_avx2,
+  count_non_255_bytes_avx2
+
+};
+
+#endif /* BITMAP_SIMD */
+
+
+/* Pick the widest kernels supported by the CPU we are running on. */
+
+static const struct bitmap_ops* bitmap_pick_ops(void) {
+
+#ifdef BITMAP_SIMD
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    return &bitmap_avx2;
+
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+    return &bitmap_sse42;
+
+#endif /* BITMAP_SIMD */
+
+  return &bitmap_scalar;
+
+}
+
+#endif /* !_HAVE_BITMAP_INL_H */
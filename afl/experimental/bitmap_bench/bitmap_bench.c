@@ -0,0 +1,336 @@
+/*
+   american fuzzy lop - bitmap kernel benchmark
+   --------------------------------------------
+
+   Checks the SIMD bitmap kernels from bitmap-inl.h against the scalar ones
+   and times all of them, on trace maps saved by afl-fuzz or on synthetic
+   sparse maps.
+
+   To collect real maps, run a P2IM fuzzing session with AFL_DUMP_TRACES
+   pointing to an empty directory; every new queue entry leaves its trace
+   there as id:NNNNNN.map. Then:
+
+     gcc -O3 -I../.. bitmap_bench.c -o bitmap_bench
+     ./bitmap_bench /path/to/traces/id:*.map
+
+   Without arguments, 256 synthetic 64 kB maps with ~500 hit tuples each are
+   used instead.
+
+ */
+
+#include "types.h"
+#include "bitmap-inl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SYNTH_MAPS   256
+#define SYNTH_SIZE   (1 << 16)
+#define SYNTH_TUPLES 500
+
+#define BENCH_NS     (200 * 1000 * 1000ULL)   /* Time budget per kernel */
+
+static u8** maps;                /* Traces being benchmarked           */
+static u8*  work;                /* Scratch copy for destructive calls */
+static u8*  virgin;              /* Union of all traces, inverted      */
+static u32  map_cnt, map_len;
+
+static u64 now_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+
+/* Load a raw trace map. All of them must have the same length. */
+
+static u8* load_map(char* fn) {
+
+  struct stat st;
+  s32 fd = open(fn, O_RDONLY);
+  u8* buf;
+
+  if (fd < 0 || fstat(fd, &st)) { perror(fn); exit(1); }
+
+  if (!map_len) map_len = st.st_size;
+
+  if (st.st_size != map_len || !map_len || map_len % 32) {
+    fprintf(stderr, "%s: bad map size %lld\n", fn, (long long)st.st_size);
+    exit(1);
+  }
+
+  buf = malloc(map_len);
+
+  if (read(fd, buf, map_len) != map_len) { perror(fn); exit(1); }
+  close(fd);
+
+  return buf;
+
+}
+
+
+/* A sparse map with mostly low hit counts, like the ones firmware produces. */
+
+static u8* synth_map(void) {
+
+  u8* buf = calloc(1, SYNTH_SIZE);
+  u32 i;
+
+  for (i = 0; i < SYNTH_TUPLES; i++) {
+
+    u32 loc = random() % SYNTH_SIZE;
+    u32 r   = random() % 100;
+
+    buf[loc] = r < 70 ? 1 : r < 90 ? 1 + random() % 8 : random() % 256;
+
+  }
+
+  return buf;
+
+}
+
+
+/* Run every kernel of ops on every map and compare with the scalar code. */
+
+static void check_ops(const struct bitmap_ops* ops) {
+
+  u8* ref_v = malloc(map_len);
+  u8* ops_v = malloc(map_len);
+  u8* ref_m = malloc(map_len >> 3);
+  u8* ops_m = malloc(map_len >> 3);
+  u32 i;
+
+  memset(ref_v, 255, map_len);
+  memset(ops_v, 255, map_len);
+
+  for (i = 0; i < map_cnt; i++) {
+
+    u8 r1, r2;
+
+#define CHECK(_what, _ok) do { \
+    if (!(_ok)) { \
+      fprintf(stderr, "%s: %s mismatch on map %u\n", ops->name, _what, i); \
+      exit(1); \
+    } \
+  } while (0)
+
+    r1 = bitmap_scalar.has_new_bits(maps[i], ref_v, map_len);
+    r2 = ops->has_new_bits(maps[i], ops_v, map_len);
+
+    CHECK("has_new_bits", r1 == r2 && !memcmp(ref_v, ops_v, map_len));
+
+    CHECK("count_bits", bitmap_scalar.count_bits(ref_v, map_len) ==
+                        ops->count_bits(ref_v, map_len));
+
+    CHECK("count_bytes", bitmap_scalar.count_bytes(maps[i], map_len) ==
+                         ops->count_bytes(maps[i], map_len));
+
+    CHECK("count_non_255_bytes",
+          bitmap_scalar.count_non_255_bytes(ref_v, map_len) ==
+          ops->count_non_255_bytes(ref_v, map_len));
+
+    memset(ref_m, 0, map_len >> 3);
+    memset(ops_m, 0, map_len >> 3);
+    bitmap_scalar.minimize_bits(ref_m, maps[i], map_len);
+    ops->minimize_bits(ops_m, maps[i], map_len);
+
+    CHECK("minimize_bits", !memcmp(ref_m, ops_m, map_len >> 3));
+
+    memcpy(work, maps[i], map_len);
+    memcpy(ops_v, maps[i], map_len);
+    bitmap_scalar.classify_counts(work, map_len);
+    ops->classify_counts(ops_v, map_len);
+
+    CHECK("classify_counts", !memcmp(work, ops_v, map_len));
+
+    memcpy(work, maps[i], map_len);
+    memcpy(ops_v, maps[i], map_len);
+    bitmap_scalar.simplify_trace(work, map_len);
+    ops->simplify_trace(ops_v, map_len);
+
+    CHECK("simplify_trace", !memcmp(work, ops_v, map_len));
+
+    memcpy(ops_v, ref_v, map_len);
+
+#undef CHECK
+
+  }
+
+  free(ref_v);
+  free(ops_v);
+  free(ref_m);
+  free(ops_m);
+
+}
+
+
+/* Time one kernel. The destructive ones get a fresh copy of the map before
+   every call; the cost of that copy is measured separately and subtracted. */
+
+enum { K_CLASSIFY, K_SIMPLIFY, K_NEW_BITS, K_MINIMIZE, K_BITS, K_BYTES,
+       K_NON_255, K_COPY, K_LAST };
+
+static const char* k_names[K_LAST] = {
+  "classify_counts", "simplify_trace", "has_new_bits", "minimize_bits",
+  "count_bits", "count_bytes", "count_non_255_bytes", "(map copy)"
+};
+
+static double time_kernel(const struct bitmap_ops* ops, u32 k) {
+
+  static volatile u32 sink;
+  u8* mini = calloc(1, map_len >> 3);
+  u64 start = now_ns(), calls = 0;
+
+  while (now_ns() - start < BENCH_NS) {
+
+    u32 i;
+
+    for (i = 0; i < map_cnt; i++, calls++) switch (k) {
+
+      case K_CLASSIFY:
+        memcpy(work, maps[i], map_len);
+        ops->classify_counts(work, map_len);
+        break;
+
+      case K_SIMPLIFY:
+        memcpy(work, maps[i], map_len);
+        ops->simplify_trace(work, map_len);
+        break;
+
+      case K_NEW_BITS:
+        sink += ops->has_new_bits(maps[i], virgin, map_len);
+        break;
+
+      case K_MINIMIZE:
+        ops->minimize_bits(mini, maps[i], map_len);
+        break;
+
+      case K_BITS:
+        sink += ops->count_bits(virgin, map_len);
+        break;
+
+      case K_BYTES:
+        sink += ops->count_bytes(maps[i], map_len);
+        break;
+
+      case K_NON_255:
+        sink += ops->count_non_255_bytes(virgin, map_len);
+        break;
+
+      case K_COPY:
+        memcpy(work, maps[i], map_len);
+        sink += work[i % map_len];
+        break;
+
+    }
+
+  }
+
+  free(mini);
+
+  return (double)(now_ns() - start) / calls;
+
+}
+
+
+int main(int argc, char** argv) {
+
+  const struct bitmap_ops* all[3];
+  u32 ops_cnt = 0, i, j, tuples = 0;
+  double copy_ns;
+
+  if (argc > 1) {
+
+    map_cnt = argc - 1;
+    maps    = malloc(map_cnt * sizeof(u8*));
+
+    for (i = 0; i < map_cnt; i++) maps[i] = load_map(argv[i + 1]);
+
+  } else {
+
+    srandom(1);
+
+    map_cnt = SYNTH_MAPS;
+    map_len = SYNTH_SIZE;
+    maps    = malloc(map_cnt * sizeof(u8*));
+
+    for (i = 0; i < map_cnt; i++) maps[i] = synth_map();
+
+  }
+
+  work   = malloc(map_len);
+  virgin = malloc(map_len);
+  memset(virgin, 255, map_len);
+
+  /* has_new_bits() and the virgin map counters are timed in the steady
+     state, where the virgin map already knows every tuple. */
+
+  for (i = 0; i < map_cnt; i++) {
+    bitmap_scalar.has_new_bits(maps[i], virgin, map_len);
+    tuples += bitmap_scalar.count_bytes(maps[i], map_len);
+  }
+
+  printf("%u maps of %u bytes, %u tuples per map on average, %u in total\n\n",
+         map_cnt, map_len, tuples / map_cnt,
+         bitmap_scalar.count_non_255_bytes(virgin, map_len));
+
+  all[ops_cnt++] = &bitmap_scalar;
+
+#ifdef BITMAP_SIMD
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+    all[ops_cnt++] = &bitmap_sse42;
+
+  if (__builtin_cpu_supports("avx2")) all[ops_cnt++] = &bitmap_avx2;
+
+#endif /* BITMAP_SIMD */
+
+  for (i = 1; i < ops_cnt; i++) check_ops(all[i]);
+
+  copy_ns = time_kernel(&bitmap_scalar, K_COPY);
+
+  printf("afl-fuzz would use the %s kernels on this CPU\n\n",
+         bitmap_pick_ops()->name);
+
+  printf("%-22s", "ns per call");
+  for (i = 0; i < ops_cnt; i++) printf("%12s", all[i]->name);
+  printf("\n");
+
+  for (j = 0; j < K_COPY; j++) {
+
+    double base = 0;
+
+    printf("%-22s", k_names[j]);
+
+    for (i = 0; i < ops_cnt; i++) {
+
+      double ns = time_kernel(all[i], j);
+
+      if (j == K_CLASSIFY || j == K_SIMPLIFY) ns -= copy_ns;
+      if (!i) base = ns;
+
+      printf("%12.1f", ns);
+      if (i) printf(" (%4.1fx)", base / ns);
+
+    }
+
+    printf("\n");
+
+  }
+
+  printf("\n(%s: %.1f ns, subtracted from destructive kernels)\n",
+         k_names[K_COPY], copy_ns);
+
+  return 0;
+
+}
@@ -21,6 +21,78 @@
 
 #define MAX_ME_INVOC_PER_CASE 6
 
-#define PM_ME_EXIT 0x50
+/* ME runs in the background while fuzzing goes on with the current model.
+   Testcases that need a model that is still being extracted are parked, up
+   to PM_ME_PARK_MAX of them, and rerun once it is published. */
+
+#define PM_ME_PARK_MAX 64
+
+/* Model registry, a file mapped by afl-fuzz instances that sync through the
+   same directory and by their fork servers, named by PM_MODEL_REG_ENV_VAR.
+   Publishing a model bumps generation by 2, it is odd while path is being
+   rewritten. Fork servers check it before each fork and switch to the new
+   model, which me.py leaves in binary form next to the JSON one. One
+   instance at a time runs ME, the one whose pid is in me_owner. */
+
+#define PM_MODEL_REG_ENV_VAR "__PM_MODEL_REG"
+#define PM_MODEL_PATH_MAX 256
+
+struct pm_model_registry {
+  unsigned int generation; /* 0 until the first model is published */
+  unsigned int next_run;   /* ME round to hand out next, N/ of me.py */
+  int me_owner;            /* afl-fuzz running ME, 0 if none */
+  char path[PM_MODEL_PATH_MAX]; /* absolute path of the published model */
+};
+
+/* On access to an unmodeled peripheral, QEMU dumps the model it ran with and
+   where the access happened to aflFile with this suffix, for ME to start
+   from. The published model is shared and left alone. */
+
+#define PM_AUP_MODEL_SUFFIX ".aup.json"
+
+/* Testcase delivery through shared memory. afl-fuzz copies each testcase
+   here instead of writing it to out_file, once QEMU has attached it (used
+   is set). out_file is written only when ME needs it. Tools that don't set
+   the env var (replay, coverage, showmap, ...) still go through the file. */
+
+#define PM_INPUT_SHM_ENV_VAR "__PM_INPUT_SHM_ID"
+#define PM_INPUT_MAX_LEN (1 * 1024 * 1024) /* MAX_FILE in config.h */
+
+/* Multi-stream testcase, giving each DR register its own input stream:
+   PM_INPUT_STREAM_MAGIC, then records of u32 key, u32 len (little endian)
+   and len bytes. key is the DR register address, 0 is the default stream
+   read by DR registers without a record. A testcase without the magic is
+   a single default stream. */
+
+#define PM_INPUT_STREAM_MAGIC "PMIS"
+#define PM_INPUT_MAX_STREAMS 64
+
+/* Havoc rounds per stream in the stream stage, scaled like HAVOC_CYCLES */
+
+#define PM_STREAM_CYCLES 64
+
+/* Sparse coverage: with edge_log set by afl-fuzz, QEMU lists every map slot
+   that goes from 0 to 1 in edges, so that afl-fuzz can classify, check and
+   reset just those. A slot whose counter wraps may be listed twice. Once
+   edge_num exceeds PM_EDGE_LIST_MAX the list is incomplete and afl-fuzz
+   falls back to scanning the whole map. */
+
+#define PM_EDGE_LIST_MAX 8192
+
+struct pm_input_shm {
+  unsigned int used;  /* set by QEMU when it reads testcase from here */
+  unsigned int len;
+  unsigned int consumed; /* end offset of bytes read by DR, set by QEMU */
+  unsigned int key_num;  /* DR registers read, set by QEMU */
+  unsigned int keys[PM_INPUT_MAX_STREAMS];
+  unsigned int tsl_num;  /* blocks translated by last exec, set by QEMU */
+  unsigned int restore_pages; /* RAM pages restored after last exec, and */
+  unsigned int restore_ns;    /* time taken, set by QEMU with -pm-persist */
+  unsigned int fork_ns;  /* fork server request to child running, by QEMU */
+  unsigned int edge_log; /* set by afl-fuzz to have QEMU fill edges */
+  unsigned int edge_num; /* slots listed since afl-fuzz reset it, by QEMU */
+  unsigned int edges[PM_EDGE_LIST_MAX];
+  unsigned char buf[PM_INPUT_MAX_LEN];
+};
 
 #endif /* ! _HAVE_PM_H */
@@ -47,6 +47,7 @@ def read_config(cfg_f):
         afl_seed    = parser.get("afl", "input"),
         afl_output  = parser.get("afl", "output"),
         qemu_bin    = parser.get("qemu", "bin"),
+        int_period  = parser.get("qemu", "int_period", fallback="1000"),
         board       = parser.get("program", "board"),
         mcu         = parser.get("program", "mcu"),
         img         = parser.get("program", "img"),
@@ -71,6 +72,9 @@ if __name__ == "__main__":
         action='store_true', help="don't run fuzzer")
     parser.add_argument("--no-skip-deterministic", dest="no_skip_deterministic",
         action='store_true', help="don't skip deterministic steps of afl")
+    parser.add_argument("--forkserver", dest="forkserver",
+        action='store_true', help="fuzz through the fork server started by "
+        "startForkserver, instead of spawning qemu for each input")
     # TODO option for resume fuzzer
 
     args = parser.parse_args()
@@ -134,6 +138,7 @@ if __name__ == "__main__":
         cmd_qemu = [cfg.qemu_bin, "-nographic", "-aflFile", seed,
           "-board", cfg.board, "-mcu", cfg.mcu, "-image", cfg.img,
           "-pm-stage", "3", "-model-input", args.model_if, 
+          "-pm-int-period", cfg.int_period,
           # options below are not used in no forkserver mode
           "-me-bin", cfg.me_bin, "-me-config", args.config]
         print("cmd_qemu: %s\n" % ' '.join(cmd_qemu))
@@ -192,11 +197,15 @@ if __name__ == "__main__":
     cmd_afl_qemu = [cfg.qemu_bin, "-nographic",
         "-board", cfg.board, "-mcu", cfg.mcu, "-image", cfg.img,
         "-pm-stage", "3", "-aflFile", "@@", 
+        "-pm-int-period", cfg.int_period,
         # options below are not used in no forkserver mode
         #"-me-bin", cfg.me_bin, "-me-config", args.config, 
         #"-model-input", args.model_if
     ]
     cmd_afl += cmd_afl_qemu
+    if args.forkserver:
+        # AFL passes model_if to qemu only in no forkserver mode
+        cmd_afl += ["-model-input", args.model_if]
 
     # run_fw.sh for crash triage
     with open("run_fw.py", "w") as f:
@@ -222,4 +231,7 @@ if __name__ == "__main__":
     print("cmd_afl: %s\n" % ' '.join(cmd_afl))
 
     if not args.no_fuzzing:
-      subprocess.call(cmd_afl, env=dict(os.environ, AFL_NO_FORKSRV=''))
+      env = dict(os.environ)
+      if not args.forkserver:
+        env["AFL_NO_FORKSRV"] = ''
+      subprocess.call(cmd_afl, env=env)
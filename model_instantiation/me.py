@@ -21,6 +21,11 @@ import configparser
 import argparse
 from argparse import Namespace
 
+# pm_model_bin.py, found before we chdir to run_num
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+    "..", "utilities", "model_bin"))
+import pm_model_bin
+
 
 def cmp(a, b):
     r = 0 if a.__eq__(b) else 1
@@ -47,6 +52,7 @@ def read_config(cfg_f):
     return Namespace(
         qemu_bin    = os.path.abspath(parser.get("qemu", "bin")),
         qemu_log    = parser.get("qemu", "log"),
+        int_period  = parser.get("qemu", "int_period", fallback="1000"),
         board       = parser.get("program", "board"),
         mcu         = parser.get("program", "mcu"),
         img         = os.path.abspath(parser.get("program", "img")),
@@ -257,6 +263,12 @@ def exit_callback():
     json.dump(model, open(model_of_final, "w"), sort_keys=True, indent=4)
     print('')
 
+    if args.run_from_fs:
+        # afl-fuzz publishes the model once we exit, have the binary form
+        # ready so that fork servers mmap it rather than parse the JSON
+        pm_model_bin.json2bin(model_of_final,
+            pm_model_bin.bin_path(model_of_final))
+
     # calculate time of execution
     exec_time = time.time() - start_time
     color_print("Execution time(seconds): ")
@@ -1129,7 +1141,8 @@ if __name__ == "__main__":
     }
 
     cmd_base = [cfg.qemu_bin, "-verbose", "-verbose", "-d", cfg.qemu_log, "-nographic",
-            "-board", cfg.board, "-mcu", cfg.mcu, "-image", cfg.img]
+            "-board", cfg.board, "-mcu", cfg.mcu, "-image", cfg.img,
+            "-pm-int-period", cfg.int_period]
 
     # bbl_cov = {(hex_str(bbl_s), hex_str(bbl_e)): cnt}
     bbl_cov = {} # reset when ME restart due to e.g. cr_ins
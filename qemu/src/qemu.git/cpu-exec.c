@@ -28,8 +28,6 @@
 #include "exec/memory-internal.h"
 #include "qemu/rcu.h"
 #include "afl/afl-qemu-cpu-inl.h"
-// Bo: check whether address range is valid
-#include "hw/arm/cortexm-mcu.h"
 #include "peri-mod/peri-mod.h"
 #include "peri-mod/interrupt.h"
 
@@ -183,12 +181,148 @@ volatile unsigned int target_bbl_cnt = 0;
 volatile unsigned int bbl_cnt_last_me = 0;
 volatile int expl_started = 0;
 volatile int int_round = 0;
+uint32_t pm_bbl_started = 0;
+int pm_tb_running = 0;
+int pm_int_countdown = FUZZING_INT_FREQ;
+
+/*
+ * P2IM per-BBL work done by cpu_tb_exec after a TB has finished, i.e. when
+ * it isn't emitted into TBs (!pm_tb_inline()). bbl_cnt is already counted.
+ * The hook is picked by pm_bbl_select on the 1st BBL, as stage, trace_f and
+ * aflFile don't change during a run. Replay in ME switches to the hook of
+ * its stage once replay_bbl_cnt is reached.
+ */
+typedef void (*pm_BBLHook)(target_ulong pc, uint16_t size);
+
+static void pm_bbl_select(target_ulong, uint16_t);
+static pm_BBLHook pm_bbl_hook = pm_bbl_select;
+
+static inline void pm_bbl_trace(target_ulong pc, uint16_t size)
+{
+    fprintf(trace_f, "BBL (0x%x, 0x%x) [%s]\n", pc, pc+size,
+      lookup_symbol(pc));
+}
+
+// interrupt firing: one interrupt/pm_int_period executed BBL
+// after startForkserver is invoked, same BBLs as gen_pm_bbl
+static inline void pm_bbl_fuzzing_int(void)
+{
+    if (-- pm_int_countdown == 0) {
+      pm_int_countdown = pm_int_period;
+      if (afl_startfs_invoked)
+        pm_fire_interrupt();
+    }
+}
+
+// unmodelled SR read detected
+// stage Fuzzing handles in that SR_r and won't reach here
+// current impl is for on-demand ME only: CR_ins del all SMR
+// and during replay we need to do SMR
+// TODO make impl uniform
+static inline void pm_bbl_sr_r_found(void)
+{
+    if (cur_bbl_SR_r_num) {
+      sr_func = lookup_symbol(cur_bbl_s);
+      // info dumped by pm_dump_model:
+      // sr_func, cur_bbl_s, bbl_cnt, cur_bbl_SR_r_num
+      // bbl_cnt dumped includes the bbl which SR_r happens
+      stage_termination(SR_R_ID);
+      if (SR_cat_by_fixup) exit(0x19);
+      else exit(0x20);
+    }
+}
+
+// During ME, fire interrupt every ME_TERM_THRESHOLD BBL.
+// exit after every interrupt is fired INT_ROUND times
+static inline void pm_bbl_me_int(void)
+{
+    if (bbl_cnt - bbl_cnt_last_me >= ME_TERM_THRESHOLD) {
+      if (int_round < INT_ROUND) {
+        pm_fire_interrupt();
+        bbl_cnt_last_me = bbl_cnt;
+      } else if (pm_stage == SR_R_ID) {
+        stage_termination(SR_R_ID);
+        exit(0x30);
+      }
+    }
+}
+
+// stage FUZZING w/ trace, w/o trace it is inlined
+static void pm_bbl_fuzzing(target_ulong pc, uint16_t size)
+{
+    pm_bbl_fuzzing_int();
+    // dump trace for coverage calculation
+    if (trace_f)
+      pm_bbl_trace(pc, size);
+}
+
+static void pm_bbl_sr_r_id(target_ulong pc, uint16_t size)
+{
+    pm_bbl_trace(pc, size);
+    pm_bbl_sr_r_found();
+    pm_bbl_me_int();
+}
+
+static void pm_bbl_sr_r_explore(target_ulong pc, uint16_t size)
+{
+    // must do this before setting expl_started
+    if (expl_started)
+      pm_bbl_trace(pc, size);
+
+    // expl_started = 1 when bbl that does SR read has been executed
+    expl_started = bbl_cnt >= target_bbl_cnt ? 1 : 0;
+
+    // worker cannot run forever
+    if (expl_started && (bbl_cnt - target_bbl_cnt > SR_R_WORKER_BBL_CNT_CAP)) {
+      // traeat as func_ret
+      stage_termination(SR_R_EXPLORE);
+      exit(0x21);
+    }
+
+    pm_bbl_me_int();
+}
+
+// replay of the testcase in ME, behaves as in stage FUZZING
+static void pm_bbl_replay(target_ulong pc, uint16_t size)
+{
+    if (bbl_cnt > replay_bbl_cnt) {
+      pm_bbl_hook = pm_stage == SR_R_ID ? pm_bbl_sr_r_id : pm_bbl_sr_r_explore;
+      pm_bbl_hook(pc, size);
+      return;
+    }
+
+    pm_bbl_fuzzing_int();
+    if (pm_stage == SR_R_ID)
+      pm_bbl_sr_r_found();
+    // dump trace for replay process for stage 1.
+    // For stage 2, we only dump trace after expl_started
+    if (trace_f && pm_stage == SR_R_ID)
+      pm_bbl_trace(pc, size);
+}
+
+static void pm_bbl_select(target_ulong pc, uint16_t size)
+{
+    switch (pm_stage) {
+    case SR_R_ID:
+      pm_bbl_hook = aflFile ? pm_bbl_replay : pm_bbl_sr_r_id;
+      break;
+    case SR_R_EXPLORE:
+      pm_bbl_hook = aflFile ? pm_bbl_replay : pm_bbl_sr_r_explore;
+      break;
+    default:
+      pm_bbl_hook = pm_bbl_fuzzing;
+      break;
+    }
+    pm_bbl_hook(pc, size);
+}
 
 /* Execute a TB, and fix up the CPU state afterwards if necessary */
-static inline tcg_target_ulong cpu_tb_exec(target_ulong pc, CPUState *cpu, uint8_t *tb_ptr, uint16_t size)
+static inline tcg_target_ulong cpu_tb_exec(TranslationBlock *exec_tb, CPUState *cpu, uint8_t *tb_ptr)
 {
     CPUArchState *env = cpu->env_ptr;
     uintptr_t next_tb;
+    target_ulong pc = exec_tb->pc;
+    uint16_t size = exec_tb->size;
 
 #if defined(DEBUG_DISAS)
     if (qemu_loglevel_mask(CPU_LOG_TB_CPU)) {
@@ -225,90 +359,14 @@ static inline tcg_target_ulong cpu_tb_exec(target_ulong pc, CPUState *cpu, uint8
             assert(cc->set_pc);
             cc->set_pc(cpu, tb->pc);
         }
-    } else {
+    } else if (!pm_tb_inline()) {
+      // otherwise done by the TB itself, see gen_aflBBlock
+
       /* we executed it, trace it */
-      AFL_QEMU_CPU_SNIPPET2(env, pc);
+      AFL_QEMU_CPU_SNIPPET2(env, exec_tb);
 
       bbl_cnt ++;
-
-      // Handle fuzzing specific operations first to speed up it
-      if ((pm_stage == FUZZING || 
-        (pm_stage == SR_R_ID || pm_stage == SR_R_EXPLORE) && 
-        aflFile && bbl_cnt <= replay_bbl_cnt)) {
-        // During fuzzing or replay process in ME
-
-        // interrupt firing: one interrupt/FUZZING_INT_FREQ executed
-        // after startForkserver is invoked
-        if (afl_startfs_invoked) {
-          if (bbl_cnt % FUZZING_INT_FREQ == 0)
-            pm_fire_interrupt();
-        }
-
-        // unmodelled SR read detected
-        // stage Fuzzing handles in that SR_r and won't reach here
-        // current impl is for on-demand ME only: CR_ins del all SMR
-        // and during replay we need to do SMR
-        // TODO make impl uniform
-        if (pm_stage == SR_R_ID && cur_bbl_SR_r_num) {
-          sr_func = lookup_symbol(cur_bbl_s);
-          // info dumped by pm_dump_model:
-          // sr_func, cur_bbl_s, bbl_cnt, cur_bbl_SR_r_num
-          // bbl_cnt dumped includes the bbl which SR_r happens
-          stage_termination(SR_R_ID);
-          if (SR_cat_by_fixup) exit(0x19);
-          else exit(0x20);
-        }
-
-        // dump trace for coverage calculation in stage FUZZING and 
-        // replay process for stage 1. 
-        // For stage 2, we only dump trace after expl_started
-        if (trace_f && pm_stage != SR_R_EXPLORE)
-          fprintf(trace_f, "BBL (0x%x, 0x%x) [%s]\n", pc, pc+size,
-            lookup_symbol(pc));
-
-      } else {
-        // stage 1/2 && not doing replay
-
-        // must do this before setting expl_started
-        if (pm_stage == SR_R_ID || (pm_stage == SR_R_EXPLORE && expl_started))
-          fprintf(trace_f, "BBL (0x%x, 0x%x) [%s]\n", pc, pc+size, 
-            lookup_symbol(pc));
-
-        if (pm_stage == SR_R_ID && cur_bbl_SR_r_num) {
-          sr_func = lookup_symbol(cur_bbl_s);
-          // info dumped by pm_dump_model:
-          // sr_func, cur_bbl_s, bbl_cnt, cur_bbl_SR_r_num
-          // bbl_cnt dumped includes the bbl which SR_r happens
-          stage_termination(SR_R_ID);
-          if (SR_cat_by_fixup) exit(0x19);
-          else exit(0x20);
-        }
-
-        if (pm_stage == SR_R_EXPLORE) {
-          // expl_started = 1 when bbl that does SR read has been executed
-          expl_started = bbl_cnt >= target_bbl_cnt ? 1 : 0;
-
-          // worker cannot run forever
-          if (expl_started && (bbl_cnt - target_bbl_cnt > SR_R_WORKER_BBL_CNT_CAP)) {
-            // traeat as func_ret
-            stage_termination(SR_R_EXPLORE);
-            exit(0x21);
-          }
-        }
-
-        // During ME, fire interrupt every ME_TERM_THRESHOLD BBL.
-        // exit after every interrupt is fired INT_ROUND times
-        if ((pm_stage == SR_R_ID || pm_stage == SR_R_EXPLORE) && 
-          (bbl_cnt - bbl_cnt_last_me) >= ME_TERM_THRESHOLD) {
-          if (int_round < INT_ROUND) {
-            pm_fire_interrupt();
-            bbl_cnt_last_me = bbl_cnt;
-          } else if (pm_stage == SR_R_ID) {
-            stage_termination(SR_R_ID);
-            exit(0x30);
-          }
-        }
-      }
+      pm_bbl_hook(pc, size);
     }
 
     if ((next_tb & TB_EXIT_MASK) == TB_EXIT_REQUESTED) {
@@ -346,7 +404,7 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     cpu->current_tb = tb;
     /* execute the generated code */
     trace_exec_tb_nocache(tb, tb->pc);
-    cpu_tb_exec(tb->pc, cpu, tb->tc_ptr, tb->size);
+    cpu_tb_exec(tb, cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
@@ -601,17 +659,17 @@ int cpu_exec(CPUArchState *env)
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
                 }
 /*
- * chaining complicates AFL's instrumentation so we disable it
+ * chaining bypasses the per-BBL work in cpu_tb_exec, so only chain when
+ * TBs do it themselves
  */
-#ifdef NOPE_NOT_NEVER
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
                    jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
+                if (next_tb != 0 && tb->page_addr[1] == -1 &&
+                    pm_tb_inline()) {
                     tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
                                 next_tb & TB_EXIT_MASK, tb);
                 }
-#endif
                 have_tb_lock = false;
                 spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
@@ -635,21 +693,10 @@ int cpu_exec(CPUArchState *env)
                     cur_bbl_s = tb->pc;
                     cur_bbl_e = tb->pc+tb->size;
 
-                    // Bo: check whether address range is valid
-                    extern CortexMState *cs_g;
-                    if (!(cs_g->flash_base <= tb->pc && tb->pc < (cs_g->flash_base+(cs_g->flash_size_kb<<10))
-        || cs_g->sram_base <= tb->pc && tb->pc < (cs_g->sram_base+(cs_g->sram_size_kb<<10))
-        || cs_g->sram_size_kb2 && cs_g->sram_base2 <= tb->pc && tb->pc < (cs_g->sram_base2+(cs_g->sram_size_kb2<<10))
-        || cs_g->sram_size_kb3 && cs_g->sram_base3 <= tb->pc && tb->pc < (cs_g->sram_base3+(cs_g->sram_size_kb3<<10))
-                        //|| 0 <= tb->pc && tb->pc < (cs_g->flash_size_kb<<10)
-                        //|| 0x0U <= tb->pc && tb->pc < 0x1000U
-                        || 0xFFFFFFF0U <= tb->pc && tb->pc <= 0xFFFFFFFFU)) {
-                        printf("[%x, %x] illegal exec at 0x%x\n", cur_bbl_s, cur_bbl_e, tb->pc);
-                        exit(-1);
-                    }
-
                     /* execute the generated code */
-                    next_tb = cpu_tb_exec(tb->pc, cpu, tc_ptr, tb->size);
+                    pm_tb_running = 1;
+                    next_tb = cpu_tb_exec(tb, cpu, tc_ptr);
+                    pm_tb_running = 0;
                     switch (next_tb & TB_EXIT_MASK) {
                     case TB_EXIT_REQUESTED:
                         /* Something asked us to stop executing
@@ -709,6 +756,15 @@ int cpu_exec(CPUArchState *env)
                 spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
                 have_tb_lock = false;
             }
+            // TB left by longjmp didn't finish exec, uncount it like
+            // cpu_tb_exec does
+            if (pm_tb_running) {
+                pm_tb_running = 0;
+                if (pm_tb_inline()) {
+                    pm_bbl_started --;
+                    pm_int_countdown ++;
+                }
+            }
         }
     } /* for(;;) */
 
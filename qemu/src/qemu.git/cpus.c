@@ -44,6 +44,7 @@
 #include "hw/nmi.h"
 #include "afl/afl.h"
 #include "peri-mod/peri-mod.h"
+#include "peri-mod/snapshot.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -1037,6 +1038,104 @@ static CPUState *restart_cpu = NULL;    /* cpu to restart */
 
 int model_loaded = 0;
 
+/* -pm-single-thread: the cpu thread runs the forkserver itself, instead of
+   handing it to the iothread. fork() only copies the calling thread, so
+   each child runs the CPU loop on its only thread, without the iothread,
+   global mutex handoffs or creating a cpu thread. */
+int pm_single_thread = 0;
+
+/* Without the iothread, TB chaining keeps the cpu in cpu_exec while the
+   firmware busy-waits, so due timers would never run. Have the kernel send
+   SIG_IPI at the next QEMU_CLOCK_VIRTUAL deadline; cpu_signal() then kicks
+   the cpu out of the chain. */
+static timer_t afl_deadline_timer;
+
+static void afl_arm_deadline_timer(void)
+{
+    int64_t deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (deadline >= 0) {
+        /* a zero it_value disarms the timer */
+        deadline = MAX(deadline, 1);
+        its.it_value.tv_sec = deadline / 1000000000LL;
+        its.it_value.tv_nsec = deadline % 1000000000LL;
+    }
+    timer_settime(afl_deadline_timer, 0, &its, NULL);
+}
+
+static void afl_forkserver_on_cpu_thread(CPUState *cpu)
+{
+    sigset_t set, oldset;
+    struct sigevent sev;
+
+    /* The iothread stays behind in the forkserver, where it may kick us
+       once while waiting for qemu_global_mutex. Don't let that interrupt
+       read/waitpid of the forkserver. */
+    sigemptyset(&set);
+    sigaddset(&set, SIG_IPI);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    cpu_disable_ticks();
+    printf("start up afl forkserver!\n");
+    afl_setup();
+    afl_forkserver(cpu->env_ptr);
+    if(aflEnableTicks) // re-enable ticks only if asked to
+        cpu_enable_ticks();
+
+    if (!afl_fork_child) {
+        /* not run by afl-fuzz, go on with the iothread as usual */
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        return;
+    }
+
+    /* we're now in the child, there's no one to hand the mutex over to */
+    iothread_requesting_mutex = false;
+    /* nor anyone left to kick us but the deadline timer */
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    if (aflEnableTicks) {
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_SIGNAL;
+        sev.sigev_signo = SIG_IPI;
+        if (timer_create(CLOCK_MONOTONIC, &sev, &afl_deadline_timer)) {
+            perror("timer_create");
+            exit(1);
+        }
+    }
+
+    if (pm_persist)
+        pm_snapshot_take(cpu);
+    afl_fork_run();
+
+    while (1) {
+        /* the main loop handles these otherwise. Reset isn't modeled for
+           the Cortex-M boards, so either request ends the run. */
+        if (qemu_shutdown_requested_get() || qemu_reset_requested_get())
+            exit(0);
+
+        /* timers are run by the main loop otherwise */
+        if (aflEnableTicks) {
+            qemu_clock_run_all_timers();
+            afl_arm_deadline_timer();
+        }
+
+        if (all_cpu_threads_idle()) {
+            /* Sleep until the deadline timer fires. Without ticks nothing
+               can wake the CPU up, so this waits for afl-fuzz's timeout.
+               exit_request is set if the timer fired since tcg_exec_all()
+               cleared it. */
+            pthread_sigmask(SIG_BLOCK, &set, &oldset);
+            if (!exit_request)
+                sigsuspend(&oldset);
+            pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+        }
+
+        tcg_exec_all();
+    }
+}
+
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
@@ -1079,17 +1178,26 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     if (pm_stage == SR_R_ID || pm_stage == SR_R_EXPLORE)
          pm_me_ena = 1; // under current impl, equivalent to rc_ena
 
-    while (!afl_wants_cpu_to_stop) {
-        tcg_exec_all();
+    afl_fork_run();
 
-        if (use_icount) {
-            int64_t deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+    for (;;) {
+        while (!afl_wants_cpu_to_stop) {
+            tcg_exec_all();
 
-            if (deadline == 0) {
-                qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+            if (use_icount) {
+                int64_t deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+
+                if (deadline == 0) {
+                    qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+                }
             }
+            qemu_tcg_wait_io_event();
         }
-        qemu_tcg_wait_io_event();
+
+        if (!pm_single_thread)
+            break;
+        afl_wants_cpu_to_stop = 0;
+        afl_forkserver_on_cpu_thread(first_cpu);
     }
 
     if(afl_wants_cpu_to_stop) {
@@ -1341,11 +1449,13 @@ gotPipeNotification(void *ctx)
 
     printf("start up afl forkserver!\n");
     afl_setup();
-    env = NULL; //XXX for now.. if we want to share JIT to the parent we will need to pass in a real env here
-    //env = restart_cpu->env_ptr;
+    // the cpu thread no longer runs TBs, so the fork server can JIT on its env
+    env = restart_cpu->env_ptr;
     afl_forkserver(env);
 
     /* we're now in the child! */
+    if (pm_persist && afl_fork_child)
+        pm_snapshot_take(restart_cpu);
     tcg_cpu_thread = NULL;
     first_cpu = restart_cpu;
     if(aflEnableTicks) // re-enable ticks only if asked to
@@ -1,15 +1,19 @@
 #include "peri-mod/peri-mod.h"
 #include "peri-mod/interrupt.h"
+#include "exec/address-spaces.h"
+#include "hw/arm/cortexm-mcu.h"
+#include <sys/mman.h>
 #include <jansson.h> // JSON load/dump
 
-/* For fast-prototyping purpose,
- * we use unassigned_mem_read/write, instead of Memory_Region
+/* Peripherals are backed by MemoryRegions (see pm_peri_map).
+ * unassigned_mem_read/write only handle accesses to unmodeled peripherals.
  */
 
 // Data structure for level 1
 pm_Peripheral * volatile pm_PeripheralList = NULL;
+pm_Peripheral **pm_peri_table[PM_PERI_L1_SIZE];
 
-// Functions on Level 1 : pm_PeripheralList
+// Functions on Level 1 : pm_PeripheralList and pm_peri_table
 
 // TODO reimplement it in a more efficient way
 // may not be necessary as we plan to implement it by MemoryRegion in the future
@@ -25,26 +29,139 @@ pm_Peripheral *create_peri(target_ulong reg_addr) {
 
     peri->next = pm_PeripheralList;
     pm_PeripheralList = peri;
+    pm_peri_table_insert(peri);
+    pm_peri_map(peri);
 
-    // TODO hardcode DR_bytes_num to 2
-    peri->DR_bytes_num = 2;
+    pm_peri_grow_regs(peri, PM_INIT_REG_NUM - 1);
     return peri;
 }
 
-pm_Peripheral *get_peri(target_ulong reg_addr) {
-    pm_Peripheral *peri = pm_PeripheralList;
-    // target_ulong base_addr = (reg_addr / PM_PERI_ADDR_RANGE) * PM_PERI_ADDR_RANGE;
-    target_ulong base_addr = reg_addr & ~(PM_PERI_ADDR_RANGE - 1);
-    while(peri) {
-        if (peri->base_addr == base_addr)
-            break;
-        peri = peri->next;
+void pm_peri_table_insert(pm_Peripheral *peri) {
+    target_ulong idx = peri->base_addr - PM_PERI_REGION_BASE;
+    pm_Peripheral ***l1;
+
+    if (idx >> PM_PERI_REGION_BITS) {
+        fprintf(stderr, "peripheral 0x%x is out of peripheral region\n",
+            peri->base_addr);
+        return;
+    }
+    idx >>= PM_PERI_ADDR_BITS;
+    l1 = &pm_peri_table[idx >> PM_PERI_L2_BITS];
+    if (!*l1)
+        *l1 = g_new0(pm_Peripheral *, PM_PERI_L2_SIZE);
+    (*l1)[idx & (PM_PERI_L2_SIZE - 1)] = peri;
+}
+
+void pm_peri_table_reset(void) {
+    int i;
+    for (i = 0; i < PM_PERI_L1_SIZE; i ++) {
+        g_free(pm_peri_table[i]);
+        pm_peri_table[i] = NULL;
     }
-    return peri;
 }
 
 // Functions on level 2: pm_Peripheral
-// Empty
+static void *pm_model_bin_mm = NULL;
+static size_t pm_model_bin_sz = 0;
+
+// whether p points into the mmap'ed binary model, i.e. cannot be g_free'd
+static inline int pm_in_model_bin(void *p) {
+    return p >= pm_model_bin_mm && p < pm_model_bin_mm + pm_model_bin_sz;
+}
+
+static void pm_model_free(void *p) {
+    if (!pm_in_model_bin(p))
+        g_free(p);
+}
+
+// grow regs/regs_cold of peri to hold regs[idx]
+void pm_peri_grow_regs(pm_Peripheral *peri, int idx) {
+    int cap = peri->reg_cap ? peri->reg_cap : PM_INIT_REG_NUM;
+    pm_MMIORegister *regs;
+    pm_MMIORegCold *regs_cold;
+
+    while (cap <= idx)
+        cap *= 2;
+    if (cap > PM_MAX_REG_NUM)
+        cap = PM_MAX_REG_NUM;
+
+    regs = g_new0(pm_MMIORegister, cap);
+    regs_cold = g_new0(pm_MMIORegCold, cap);
+    if (peri->reg_cap) {
+        memcpy(regs, peri->regs, sizeof(pm_MMIORegister) * peri->reg_cap);
+        memcpy(regs_cold, peri->regs_cold, sizeof(pm_MMIORegCold) * peri->reg_cap);
+    }
+    pm_model_free(peri->regs);
+    pm_model_free(peri->regs_cold);
+    peri->regs = regs;
+    peri->regs_cold = regs_cold;
+    peri->reg_cap = cap;
+}
+
+static void pm_free_peri(pm_Peripheral *peri) {
+    unsigned int i;
+    pm_peri_unmap(peri);
+    pm_model_free(peri->regs);
+    pm_model_free(peri->regs_cold);
+    for (i = 0; i < peri->evt_num; i ++) {
+        pm_model_free(peri->events[i].CR_val);
+        pm_model_free(peri->events[i].satisfy);
+    }
+    pm_model_free(peri->events);
+    g_free(peri->evt_hash);
+    pm_model_free(peri);
+}
+
+static uint64_t pm_peri_read(void *opaque, hwaddr offset, unsigned size) {
+    pm_Peripheral *peri = opaque;
+    return pm_mmio_read(peri, peri->base_addr + offset, size);
+}
+
+static void pm_peri_write(void *opaque, hwaddr offset, uint64_t val,
+                          unsigned size) {
+    pm_Peripheral *peri = opaque;
+    pm_mmio_write(peri, peri->base_addr + offset, val, size);
+}
+
+static const MemoryRegionOps pm_peri_ops = {
+    .read = pm_peri_read,
+    .write = pm_peri_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    // firmware may do any access, pm_mmio_read/write handle it
+    .valid.unaligned = true,
+};
+
+/*
+ * MRs of unloaded peripherals. Flatviews waiting for RCU still unref them,
+ * so they cannot be finalized. Instead pm_peri_map reuses them.
+ */
+static GSList *pm_peri_mr_pool = NULL;
+
+void pm_peri_map(pm_Peripheral *peri) {
+    MemoryRegion *mr;
+
+    if (pm_peri_mr_pool) {
+        mr = pm_peri_mr_pool->data;
+        pm_peri_mr_pool = g_slist_delete_link(pm_peri_mr_pool, pm_peri_mr_pool);
+        mr->opaque = peri;
+    } else {
+        mr = g_new0(MemoryRegion, 1);
+        memory_region_init_io(mr, NULL, &pm_peri_ops, peri, "pm-peri",
+            PM_PERI_ADDR_RANGE);
+    }
+    peri->mr = mr;
+    // lowest priority, real device models (e.g. bitband) win
+    memory_region_add_subregion_overlap(get_system_memory(), peri->base_addr,
+        mr, -1);
+}
+
+void pm_peri_unmap(pm_Peripheral *peri) {
+    if (!peri->mr)
+        return;
+    memory_region_del_subregion(get_system_memory(), peri->mr);
+    pm_peri_mr_pool = g_slist_prepend(pm_peri_mr_pool, peri->mr);
+    peri->mr = NULL;
+}
 
 // Functions on level 3: pm_MMIORegister
 char *pm_rt_str(pm_reg_type_t reg) {
@@ -60,11 +177,12 @@ target_ulong pm_SR_read(pm_Peripheral *peri, pm_Event *e, unsigned int reg_idx)
 
     if (e->satisfy_num == 0) return 0;
 
-    set_clear = e->satisfy[e->cur_satisfy][e->cur_sr][0];
+    uint8_t *sat = pm_evt_satisfy(e, e->cur_satisfy, e->cur_sr);
+    set_clear = sat[0];
     if (set_clear) {
       int i;
       for (i = 0; i < e->set_bits; i ++)
-        ret_val |= 1 << e->satisfy[e->cur_satisfy][e->cur_sr][i+1];
+        ret_val |= 1 << sat[i+1];
     } // for clear, we needn't clear it explicitly
 
     // move to next SR on current srr_site
@@ -77,38 +195,142 @@ target_ulong pm_SR_read(pm_Peripheral *peri, pm_Event *e, unsigned int reg_idx)
     return ret_val;
 }
 
-pm_Event *pm_SR_find_model(uint32_t bbl_e, pm_Peripheral *peri, pm_MMIORegister *reg) {
-    int i, i_b, CR_val_idx = 0, np;
-    char CR_val[PM_MAX_CR_VAL_BYTE] = {};
-    target_ulong cr_val;
-    for(i = 0; i <= peri->max_reg_idx; i ++)
-        if (peri->regs[i].type == CR || peri->regs[i].type == CR_SR) {
-            cr_val = 0;
-            for (i_b = 0; i_b < 4; i_b ++) {
-              cr_val |= peri->regs[i].val_b[i_b] << (i_b * 8);
-            }
-            np = snprintf(CR_val+CR_val_idx, PM_MAX_CR_VAL_BYTE-CR_val_idx,
-                "%d:0x%x,", i, cr_val);
-            CR_val_idx += np;
-            if (CR_val_idx >= PM_MAX_CR_VAL_BYTE) {
-              fprintf(stderr, "too many CR_val bytes!\n");
-              exit(0x80);
-            }
-        }
-    CR_val[CR_val_idx-1] = '\0'; // remove the last ','
+static inline unsigned int pm_evt_slot(uint32_t cr_key, target_ulong bbl_e) {
+    uint32_t h = cr_key ^ (bbl_e * 0x9e3779b1U);
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    return h;
+}
+
+// whether CR_val of e equals current CR/CR_SR values of peri
+static int pm_evt_cr_match(pm_Peripheral *peri, pm_Event *e) {
+    int i;
+    if (e->cr_key != peri->cr_key || e->cr_num != peri->cr_num)
+        return 0;
+    for (i = 0; i < e->cr_num; i ++) {
+        if (e->CR_val[i].idx >= peri->reg_cap)
+            return 0;
+        pm_MMIORegister *reg = &peri->regs[e->CR_val[i].idx];
+        if (!pm_is_cr(reg->type) || pm_reg_val(reg) != e->CR_val[i].val)
+            return 0;
+    }
+    return 1;
+}
 
-    for(i = 0; i < peri->evt_num; i ++)
-        if(!strncmp(CR_val, peri->events[i].CR_val, PM_MAX_CR_VAL_BYTE) && 
-          (peri->events[i].bbl_e == bbl_e))
+pm_Event *pm_SR_find_model(uint32_t bbl_e, pm_Peripheral *peri, pm_MMIORegister *reg) {
+    unsigned int slot = pm_evt_slot(peri->cr_key, bbl_e) & peri->evt_hash_mask;
+    pm_Event *e;
+
+    if (!peri->evt_hash)
+        return NULL;
+    // at least half of evt_hash is empty, so probing terminates
+    while (peri->evt_hash[slot]) {
+        e = &peri->events[peri->evt_hash[slot] - 1];
+        if (e->bbl_e == bbl_e && pm_evt_cr_match(peri, e))
           if (reg->type == SR || 
-            reg->type == CR_SR && reg->r_idx_in_bbl == peri->events[i].r_idx)
-            return &peri->events[i];
+            reg->type == CR_SR && reg->r_idx_in_bbl == e->r_idx)
+            return e;
+        slot = (slot + 1) & peri->evt_hash_mask;
+    }
     return NULL;
 }
 
+void pm_cr_key_retype(pm_Peripheral *peri, int idx, pm_reg_type_t prev_type) {
+    pm_MMIORegister *reg = &peri->regs[idx];
+    if (pm_is_cr(prev_type) == pm_is_cr(reg->type))
+        return;
+    peri->cr_key ^= pm_cr_hash(idx, pm_reg_val(reg));
+    peri->cr_num += pm_is_cr(reg->type) ? 1 : -1;
+}
+
+void pm_cr_key_rebuild(pm_Peripheral *peri) {
+    int i;
+    peri->cr_key = 0;
+    peri->cr_num = 0;
+    for (i = 0; i <= peri->max_reg_idx; i ++)
+        if (pm_is_cr(peri->regs[i].type)) {
+            peri->cr_key ^= pm_cr_hash(i, pm_reg_val(&peri->regs[i]));
+            peri->cr_num ++;
+        }
+}
+
+void pm_evt_index_build(pm_Peripheral *peri) {
+    unsigned int i, slot, size = 2;
+
+    g_free(peri->evt_hash);
+    peri->evt_hash = NULL;
+    peri->evt_hash_mask = 0;
+    if (!peri->evt_num)
+        return;
+
+    // power of 2 and at least twice evt_num
+    while (size < peri->evt_num * 2)
+        size *= 2;
+    peri->evt_hash = g_new0(uint16_t, size);
+    peri->evt_hash_mask = size - 1;
+    for (i = 0; i < peri->evt_num; i ++) {
+        slot = pm_evt_slot(peri->events[i].cr_key, peri->events[i].bbl_e)
+            & peri->evt_hash_mask;
+        while (peri->evt_hash[slot])
+            slot = (slot + 1) & peri->evt_hash_mask;
+        peri->evt_hash[slot] = i + 1;
+    }
+}
+
+// parse CR_val "idx:0xval,idx:0xval" of JSON into e, returns 0 on success
+static int pm_parse_CR_val(const char *CR_val, pm_Event *e) {
+    const char *p = CR_val;
+    char *end;
+    int n = *p ? 1 : 0;
+
+    // one pair per comma-separated field
+    for (; *p; p ++)
+        if (*p == ',') n ++;
+    if (n > PM_MAX_REG_NUM)
+        return -1;
+    e->CR_val = g_new(pm_CRVal, n);
+
+    p = CR_val;
+    e->cr_num = 0;
+    e->cr_key = 0;
+    while (*p) {
+        if (e->cr_num >= n)
+            return -1;
+        pm_CRVal *cv = &e->CR_val[e->cr_num];
+        errno = 0;
+        cv->idx = strtol(p, &end, 10);
+        if (end == p || *end != ':' || errno ||
+            cv->idx < 0 || cv->idx >= PM_MAX_REG_NUM)
+            return -1;
+        p = end + 1;
+        cv->val = strtoul(p, &end, 0);
+        if (end == p || (*end != ',' && *end) || errno)
+            return -1;
+        p = *end ? end + 1 : end;
+
+        e->cr_key ^= pm_cr_hash(cv->idx, cv->val);
+        e->cr_num ++;
+    }
+    return 0;
+}
+
 
 // Stage SR_R_EXPLORE
 uint32_t *sr_func_ret_addr = NULL;
+int pm_code_addr_ok(uint32_t pc) {
+    extern CortexMState *cs_g;
+
+#define IN_REGION(base, kb) ((kb) && (base) <= pc && pc < (base) + ((kb) << 10))
+
+    return IN_REGION(cs_g->flash_base, cs_g->flash_size_kb) ||
+           IN_REGION(cs_g->sram_base,  cs_g->sram_size_kb)  ||
+           IN_REGION(cs_g->sram_base2, cs_g->sram_size_kb2) ||
+           IN_REGION(cs_g->sram_base3, cs_g->sram_size_kb3);
+
+#undef IN_REGION
+}
+
 int is_sr_func_ret_addr(uint32_t pc) {
     // sr_func_ret_addr: NULL terminated array on heap storing sr_func ret_addr
     uint32_t *ret_addr = sr_func_ret_addr;
@@ -153,26 +375,30 @@ int pm_dump_model(pm_Peripheral *peri) {
     json_t *root = json_object();
     json_t *jperis = json_object();
     while(peri) {
-        json_t *jperi = json_pack("{s:i, s:i}", 
-          "DR_bytes_num", peri->DR_bytes_num, "reg_size", peri->reg_size);
+        json_t *jperi = json_pack("{s:i}", "reg_size", peri->reg_size);
 
         // regs
         json_t *jregs = json_array(), *jreg;
         for (i = 0; i <= peri->max_reg_idx; i++) {
           pm_reg_type_t type = peri->regs[i].type;
+          pm_MMIORegCold *cold = &peri->regs_cold[i];
           if (type == UC) {
-            jreg = json_pack("{s:i}", "type", peri->regs[i].type); 
+            jreg = json_pack("{s:i}", "type", type); 
           } else {
-            jreg = json_pack("{s:i, s:i, s:i}", "type", peri->regs[i].type, 
-              "read", peri->regs[i].read, "write", peri->regs[i].write);
+            jreg = json_pack("{s:i, s:i, s:i}", "type", type, 
+              "read", cold->read, "write", cold->write);
             if (type == SR || type == CR_SR) {
               json_object_set_new(jreg, "sr_locked",
                 json_integer(peri->regs[i].sr_locked));
             }
             if (type == CR || type == CR_SR) {
-              snprintf(hex_str, 16, "0x%x", peri->regs[i].cr_val);
+              snprintf(hex_str, 16, "0x%x", cold->cr_val);
               json_object_set_new(jreg, "cr_value", json_string(hex_str));
             }
+            if (type == DR && peri->regs[i].dr_bytes) {
+              json_object_set_new(jreg, "dr_bytes",
+                json_integer(peri->regs[i].dr_bytes));
+            }
           }
 
           json_array_append_new(jregs, jreg);
@@ -207,7 +433,7 @@ int pm_dump_model(pm_Peripheral *peri) {
     json_t *jints = json_array(), *jint;
     for (i = 0; i < pm_interrupt->arr_size; i++) {
       jint = json_pack("{s:i, s:i}", "excp_num", pm_interrupt->arr[i].int_num, 
-        "enabled", pm_interrupt->arr[i].enabled);
+        "enabled", (pm_interrupt->enabled >> i) & 1);
       json_array_append_new(jints, jint);
     }
     json_object_set_new(root, "interrupts", jints);
@@ -240,7 +466,15 @@ int pm_dump_model(pm_Peripheral *peri) {
             "aup_reason", aup_reason);
         json_object_set_new(root, "access_to_unmodeled_peri", jaup);
 
-        model_of = model_if; // reuse model_if
+        // model_if is published to every fuzzer instance and may be loaded
+        // by another fork server right now, so dump next to aflFile instead
+        static char aup_of[PATH_MAX];
+        if (aflFile) {
+            snprintf(aup_of, sizeof(aup_of), "%s" PM_AUP_MODEL_SUFFIX,
+                aflFile);
+            model_of = aup_of;
+        } else
+            model_of = model_if; // reuse model_if
     }
 
     // copy "access_to_unmodeled_peri" from model_if
@@ -257,7 +491,7 @@ int pm_dump_model(pm_Peripheral *peri) {
 
 unsigned int replay_bbl_cnt = 0;
 
-int pm_load_model(pm_Peripheral **pm_PList) {
+static int pm_load_model_json(pm_Peripheral **pm_PList) {
     // returns 0/-1/-2 on success/json loading error/too many XX or conversion error
     pm_Peripheral *plist = NULL;
 
@@ -285,7 +519,7 @@ int pm_load_model(pm_Peripheral **pm_PList) {
     }
 
 
-    int j, k, l;
+    int j, k, l, m;
     const char *base_addr;
     json_t *jperi;
     json_object_foreach(jperis, base_addr, jperi) {
@@ -298,9 +532,9 @@ int pm_load_model(pm_Peripheral **pm_PList) {
         peri->base_addr = strtol(base_addr, NULL, 0);
 
         json_t *jregs, *jevents;
-        status = json_unpack_ex(jperi, &error, 0, "{s:i, s:i, s:o, s:o}", 
-            "DR_bytes_num", &peri->DR_bytes_num, "reg_size", &peri->reg_size, 
-            "regs", &jregs, "events", &jevents);
+        // DR_bytes_num of old models is superseded by per-reg dr_bytes
+        status = json_unpack_ex(jperi, &error, 0, "{s:i, s:o, s:o}", 
+            "reg_size", &peri->reg_size, "regs", &jregs, "events", &jevents);
         if (status) goto error;
 
 
@@ -310,23 +544,38 @@ int pm_load_model(pm_Peripheral **pm_PList) {
             json_decref(root);
             return -1;
         }
+        if (json_array_size(jregs) > PM_MAX_REG_NUM) {
+            fprintf(stderr, "error: too many regs!\n");
+            return -2;
+        }
         peri->max_reg_idx = json_array_size(jregs) - 1;
+        // right-sized, pm_peri_reg grows it for regs accessed the first time
+        peri->reg_cap = json_array_size(jregs);
+        peri->regs = g_new0(pm_MMIORegister, peri->reg_cap);
+        peri->regs_cold = g_new0(pm_MMIORegCold, peri->reg_cap);
 
         json_t *jreg;
         json_array_foreach(jregs, j, jreg) {
-            // when reg_type is UC, last 2 k,v don't exist and are not loaded.
-            status = json_unpack_ex(jreg, &error, 0, "{s:i, s?:i, s?:i}",
-              "type", &peri->regs[j].type, 
-              "read", &peri->regs[j].read, "write", &peri->regs[j].write);
+            int type = UC, sr_locked = 0, dr_bytes = 0;
+            // when reg_type is UC, last 3 k,v don't exist and are not loaded.
+            status = json_unpack_ex(jreg, &error, 0, "{s:i, s?:i, s?:i, s?:i}",
+              "type", &type, 
+              "read", &peri->regs_cold[j].read, "write", &peri->regs_cold[j].write,
+              "dr_bytes", &dr_bytes);
             if (status) goto error;
 
-            pm_reg_type_t type = peri->regs[j].type;
-
             if (type == SR || type == CR_SR) {
               status = json_unpack_ex(jreg, &error, 0, "{s:i}", 
-                "sr_locked", &peri->regs[j].sr_locked);
+                "sr_locked", &sr_locked);
             }
             if (status) goto error;
+            peri->regs[j].type = type;
+            peri->regs[j].sr_locked = sr_locked;
+            if (dr_bytes < 0 || dr_bytes > sizeof(target_ulong)) {
+              fprintf(stderr, "error: invalid dr_bytes %d\n", dr_bytes);
+              return -2;
+            }
+            peri->regs[j].dr_bytes = dr_bytes;
         }
 
 
@@ -340,7 +589,8 @@ int pm_load_model(pm_Peripheral **pm_PList) {
         const char *CR_val, *key;
         json_t *jval0, *jval;
         json_t *jsatisfy, *jbc, *jb;
-        peri->evt_num = 0;
+        size_t evt_num = 0;
+        // events are right-sized, so count them first
         json_object_foreach(jevents, CR_val, jval0) {
         if(!json_is_object(jval0)) {
           fprintf(stderr, "error: events[%s] is not an object\n", CR_val);
@@ -351,15 +601,24 @@ int pm_load_model(pm_Peripheral **pm_PList) {
           fprintf(stderr, "error: too many bytes in CR_val\n");
           return -2;
         }
+        evt_num += json_object_size(jval0);
+        }
+        if (evt_num > PM_MAX_EVT_NUM) {
+          fprintf(stderr, "error: too many events!\n");
+          return -2;
+        }
+        peri->events = g_new0(pm_Event, evt_num);
 
+        peri->evt_num = 0;
+        json_object_foreach(jevents, CR_val, jval0) {
         json_object_foreach(jval0, key, jval) {
-          if (peri->evt_num >= PM_MAX_EVT_NUM) {
-            fprintf(stderr, "error: too many events!\n");
-            return -2;
-          }
           pm_Event *e = &peri->events[peri->evt_num];
+          int sr_num, set_bits, r_idx = 0;
 
-          strncpy(e->CR_val, CR_val, PM_MAX_CR_VAL_BYTE);
+          if (pm_parse_CR_val(CR_val, e)) {
+            fprintf(stderr, "error: malformed CR_val %s\n", CR_val);
+            return -2;
+          }
           e->bbl_e = strtol(key, NULL, 0);
           if ((errno == ERANGE && (e->bbl_e == LONG_MAX || e->bbl_e == LONG_MIN))
                    || (errno != 0 && e->bbl_e == 0)) {
@@ -368,8 +627,17 @@ int pm_load_model(pm_Peripheral **pm_PList) {
           }
 
           status = json_unpack_ex(jval, &error, 0, "{s:i, s:i, s?:i, s:o}", 
-            "sr_num", &e->sr_num, "set_bits", &e->set_bits, 
-            "CR_SR_r_idx", &e->r_idx, "satisfy", &jsatisfy);
+            "sr_num", &sr_num, "set_bits", &set_bits, 
+            "CR_SR_r_idx", &r_idx, "satisfy", &jsatisfy);
+          if (status) goto error;
+          if (sr_num < 0 || sr_num > PM_MAX_BIT_COMB_SZ ||
+              set_bits < 0 || set_bits >= PM_SET_BITS || r_idx < 0 || r_idx > 0xff) {
+            fprintf(stderr, "error: sr_num/set_bits/CR_SR_r_idx out of range!\n");
+            return -2;
+          }
+          e->sr_num = sr_num;
+          e->set_bits = set_bits;
+          e->r_idx = r_idx;
 
           // satisfy
           if(!json_is_array(jsatisfy)) {
@@ -377,12 +645,18 @@ int pm_load_model(pm_Peripheral **pm_PList) {
             json_decref(root);
             return -1;
           }
+          if (json_array_size(jsatisfy) > PM_MAX_SATISFY_NUM) {
+            fprintf(stderr, "error: too many bit combinations in satisfy!\n");
+            return -2;
+          }
+          e->satisfy_num = json_array_size(jsatisfy);
+          if (e->satisfy_num && !e->sr_num) {
+            // pm_SR_read would index an empty satisfy
+            fprintf(stderr, "error: satisfy without SR, sr_num is 0!\n");
+            return -2;
+          }
+          e->satisfy = g_new0(uint8_t, e->satisfy_num * e->sr_num * (e->set_bits+1));
           json_array_foreach(jsatisfy, k, jbc) {
-            if (k >= PM_MAX_SATISFY_NUM) {
-              fprintf(stderr, "error: too many bit combinations in satisfy!\n");
-              return -2;
-            }
-
             if(!json_is_array(jbc)) {
               fprintf(stderr, "error: bit combination is not an array\n");
               json_decref(root);
@@ -393,31 +667,34 @@ int pm_load_model(pm_Peripheral **pm_PList) {
                 fprintf(stderr, "error: too many bits in bit combination %d!\n", k);
                 return -2;
               }
-              int m, l1;
+              int b[2];
+              uint8_t *sat = pm_evt_satisfy(e, k, l/2);
               if (l%2 == 0) { // bits
-                l1 = l/2;
                 if (e->set_bits == 1) {
-                  status = json_unpack_ex(jb, &error, 0, "[i]", 
-                    &e->satisfy[k][l1][1]);
+                  status = json_unpack_ex(jb, &error, 0, "[i]", &b[0]);
                 } else if (e->set_bits == 2) {
-                  status = json_unpack_ex(jb, &error, 0, "[i,i]", 
-                    &e->satisfy[k][l1][1], &e->satisfy[k][l1][2]);
+                  status = json_unpack_ex(jb, &error, 0, "[i,i]", &b[0], &b[1]);
                 } else {
                   fprintf(stderr, "error: unexpected set_bits");
                   return -2;
                 }
+                if (status) goto error;
+                for (m = 0; m < e->set_bits; m ++)
+                  sat[m+1] = b[m];
               } else { // set/clear
-                  status = json_unpack_ex(jb, &error, 0, "i", 
-                    &e->satisfy[k][l1][0]);
+                  status = json_unpack_ex(jb, &error, 0, "i", &b[0]);
+                  if (status) goto error;
+                  sat[0] = b[0];
               }
-              if (status) goto error;
             }
           }
-          e->satisfy_num = k;
 
           peri->evt_num ++;
         }
         }
+
+        pm_cr_key_rebuild(peri);
+        pm_evt_index_build(peri);
     }
 
     if (pm_stage == SR_R_EXPLORE) {
@@ -445,16 +722,6 @@ int pm_load_model(pm_Peripheral **pm_PList) {
         status = json_unpack_ex(root, &error, 0, "{s:{s:i}}", 
             "access_to_unmodeled_peri", "replay_bbl_cnt", &replay_bbl_cnt);
         if (status) goto error;
-
-        if (pm_stage == SR_R_EXPLORE) {
-          if (target_bbl_cnt <= replay_bbl_cnt)
-            // For SMR, replay must stop before executing the BBL reading SR, 
-            // so that after executing the BBL, it can start stage 2, i.e. 
-            // set expl_started to 1. SMR may start before replay finish, e.g. 
-            // due to cr_ins which deletes all SM for a peripheral. 
-            // We gurantee replay finishes in time by: 
-            replay_bbl_cnt = target_bbl_cnt - 1;
-        }
     }
 
     json_decref(root);
@@ -469,20 +736,330 @@ error:
 }
 
 
-pm_Peripheral *pm_reload_model(void) {
+/*
+ * Binary model
+ *
+ * me.py spawns a QEMU per bit combination, each parsing the same JSON model.
+ * After parsing JSON, QEMU caches the model next to it (foo.json -> foo.bin)
+ * as an image of the pm_Peripheral array, followed by sr_func_ret_addr and
+ * the regs/events arrays of each peripheral. Pointers in the image hold
+ * offsets from its start. Later loads mmap the image and use it in place,
+ * only turning offsets into pointers and rebuilding lookup structures.
+ * utilities/model_bin/pm_model_bin.py converts between JSON and binary.
+ *
+ * The binary is used only if it's converted from the JSON as is (same size
+ * and mtime), built with the same struct layouts, and contains all
+ * sections the current stage needs. Otherwise JSON is parsed.
+ */
+#define PM_MODEL_BIN_ALIGN(off) (((off) + 7) & ~(size_t)7)
+
+static char *pm_model_bin_path(void) {
+    size_t len = strlen(model_if);
+    if (len > 5 && !strcmp(model_if + len - 5, ".json"))
+        return g_strdup_printf("%.*s.bin", (int)(len - 5), model_if);
+    return g_strdup_printf("%s.bin", model_if);
+}
+
+static uint32_t pm_model_bin_flags_needed(void) {
+    uint32_t flags = 0;
+    if (pm_stage == SR_R_EXPLORE)
+        flags |= PM_MODEL_BIN_SR_READ;
+    if (aflFile && (pm_stage == SR_R_ID || pm_stage == SR_R_EXPLORE))
+        flags |= PM_MODEL_BIN_AUP;
+    return flags;
+}
+
+// turn offset in *field into pointer to len bytes of mm, returns 0 on success
+static int pm_model_bin_fixup(void *mm, size_t sz, void **field, size_t len) {
+    uintptr_t off = (uintptr_t)*field;
+
+    if (!len) {
+        *field = NULL;
+        return 0;
+    }
+    if (off < sizeof(pm_ModelBinHdr) || off & 7 || off > sz || len > sz - off)
+        return -1;
+    *field = mm + off;
+    return 0;
+}
+
+static int pm_load_model_bin(pm_Peripheral **pm_PList) {
+    // returns 0 on success, -1 if binary model is missing or unusable
+    struct stat json_st, sb;
+    pm_ModelBinHdr *hdr;
+    pm_Peripheral *peris;
+    uint32_t *ret_addr;
+    void *mm;
+    char *bin;
+    int fd, i, j, k;
+
+    if (stat(model_if, &json_st) == -1)
+        return -1;
+
+    bin = pm_model_bin_path();
+    fd = open(bin, O_RDONLY);
+    g_free(bin);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(pm_ModelBinHdr)) {
+        close(fd);
+        return -1;
+    }
+    // private, so peripherals can be modified in place
+    mm = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mm == MAP_FAILED)
+        return -1;
+
+    hdr = mm;
+    if (hdr->magic != PM_MODEL_BIN_MAGIC || hdr->version != PM_MODEL_BIN_VERSION
+        || hdr->hdr_size != sizeof(pm_ModelBinHdr)
+        || hdr->peri_size != sizeof(pm_Peripheral)
+        || hdr->evt_size != sizeof(pm_Event)
+        || hdr->reg_size != sizeof(pm_MMIORegister)
+        || hdr->reg_cold_size != sizeof(pm_MMIORegCold)
+        || sb.st_size < sizeof(pm_ModelBinHdr) + 
+           (uint64_t)hdr->peri_num * sizeof(pm_Peripheral) +
+           (uint64_t)hdr->sr_func_ret_num * sizeof(uint32_t)
+        || hdr->json_size != json_st.st_size
+        || hdr->json_mtime_ns != json_st.st_mtim.tv_sec * 1000000000LL +
+           json_st.st_mtim.tv_nsec
+        || (hdr->flags & pm_model_bin_flags_needed()) != pm_model_bin_flags_needed()) {
+        munmap(mm, sb.st_size);
+        return -1;
+    }
+
+    peris = (pm_Peripheral *)(hdr + 1);
+    for (i = 0; i < hdr->peri_num; i ++) {
+        pm_Peripheral *peri = &peris[i];
+        if (peri->evt_num > PM_MAX_EVT_NUM || peri->reg_cap < 0 ||
+            peri->reg_cap > PM_MAX_REG_NUM || peri->max_reg_idx < -1 ||
+            peri->max_reg_idx >= peri->reg_cap ||
+            pm_model_bin_fixup(mm, sb.st_size, (void **)&peri->regs,
+                sizeof(pm_MMIORegister) * peri->reg_cap) ||
+            pm_model_bin_fixup(mm, sb.st_size, (void **)&peri->regs_cold,
+                sizeof(pm_MMIORegCold) * peri->reg_cap) ||
+            pm_model_bin_fixup(mm, sb.st_size, (void **)&peri->events,
+                sizeof(pm_Event) * peri->evt_num))
+            goto corrupted;
+        peri->next = i + 1 < hdr->peri_num ? &peris[i+1] : NULL;
+        peri->mr = NULL;
+        peri->evt_hash = NULL;
+
+        // derived fields, not necessarily filled by converter
+        for (j = 0; j < peri->evt_num; j ++) {
+            pm_Event *e = &peri->events[j];
+            if (e->satisfy_num > PM_MAX_SATISFY_NUM ||
+                (e->satisfy_num && !e->sr_num) ||
+                e->sr_num > PM_MAX_BIT_COMB_SZ || e->set_bits >= PM_SET_BITS ||
+                pm_model_bin_fixup(mm, sb.st_size, (void **)&e->CR_val,
+                    sizeof(pm_CRVal) * e->cr_num) ||
+                pm_model_bin_fixup(mm, sb.st_size, (void **)&e->satisfy,
+                    e->satisfy_num * e->sr_num * (e->set_bits + 1)))
+                goto corrupted;
+            e->cr_key = 0;
+            for (k = 0; k < e->cr_num; k ++) {
+                if (e->CR_val[k].idx < 0 || e->CR_val[k].idx >= PM_MAX_REG_NUM)
+                    goto corrupted;
+                e->cr_key ^= pm_cr_hash(e->CR_val[k].idx, e->CR_val[k].val);
+            }
+        }
+        pm_cr_key_rebuild(peri);
+        pm_evt_index_build(peri);
+    }
+
+    if (pm_stage == SR_R_EXPLORE) {
+        srr_site = hdr->srr_site;
+        CR_SR_r_idx_in_bbl = hdr->CR_SR_r_idx;
+        target_bbl_cnt = hdr->target_bbl_cnt;
+        // copied, it may outlive the mapping
+        ret_addr = (uint32_t *)(peris + hdr->peri_num);
+        sr_func_ret_addr = g_malloc(sizeof(uint32_t) * (hdr->sr_func_ret_num+1));
+        memcpy(sr_func_ret_addr, ret_addr, sizeof(uint32_t) * hdr->sr_func_ret_num);
+        sr_func_ret_addr[hdr->sr_func_ret_num] = 0;
+    }
+    if (pm_model_bin_flags_needed() & PM_MODEL_BIN_AUP)
+        replay_bbl_cnt = hdr->replay_bbl_cnt;
+
+    pm_model_bin_mm = mm;
+    pm_model_bin_sz = sb.st_size;
+    *pm_PList = hdr->peri_num ? peris : NULL;
+    return 0;
+
+corrupted:
+    fprintf(stderr, "error: corrupted binary model, fall back to JSON\n");
+    for (j = 0; j < i; j ++)
+        g_free(peris[j].evt_hash);
+    munmap(mm, sb.st_size);
+    return -1;
+}
+
+// copy len bytes of src to buf + off, storing the offset in *field
+// returns end of the copy. buf is NULL when only sizing the image
+static size_t pm_model_bin_put(char *buf, size_t off, void **field,
+        const void *src, size_t len) {
+    off = PM_MODEL_BIN_ALIGN(off);
+    if (buf) {
+        if (len)
+            memcpy(buf + off, src, len);
+        *field = len ? (void *)(uintptr_t)off : NULL;
+    }
+    return off + len;
+}
+
+// lay arrays of plist out from off on, returns image size
+static size_t pm_model_bin_layout(pm_Peripheral *plist, char *buf, size_t off) {
+    pm_Peripheral *peri, *img = buf ? (pm_Peripheral *)(buf + sizeof(pm_ModelBinHdr)) : NULL;
+    pm_Event *evts = NULL;
+    void *unused;
+    unsigned int j;
+
+    for (peri = plist; peri; peri = peri->next) {
+        // only registers known by model, the rest are grown on demand
+        int reg_num = peri->max_reg_idx + 1;
+        if (img) {
+            memcpy(img, peri, sizeof(pm_Peripheral));
+            img->reg_cap = reg_num;
+            img->evt_hash = NULL;
+            img->evt_hash_mask = 0;
+            img->mr = NULL;
+            img->next = NULL;
+        }
+        off = pm_model_bin_put(buf, off, img ? (void **)&img->regs : &unused,
+            peri->regs, sizeof(pm_MMIORegister) * reg_num);
+        off = pm_model_bin_put(buf, off, img ? (void **)&img->regs_cold : &unused,
+            peri->regs_cold, sizeof(pm_MMIORegCold) * reg_num);
+        off = pm_model_bin_put(buf, off, img ? (void **)&img->events : &unused,
+            peri->events, sizeof(pm_Event) * peri->evt_num);
+        if (buf)
+            evts = (pm_Event *)(buf + off) - peri->evt_num;
+        for (j = 0; j < peri->evt_num; j ++) {
+            pm_Event *e = &peri->events[j];
+            off = pm_model_bin_put(buf, off, evts ? (void **)&evts[j].CR_val : &unused,
+                e->CR_val, sizeof(pm_CRVal) * e->cr_num);
+            off = pm_model_bin_put(buf, off, evts ? (void **)&evts[j].satisfy : &unused,
+                e->satisfy, e->satisfy_num * e->sr_num * (e->set_bits + 1));
+        }
+        if (img)
+            img ++;
+    }
+    return off;
+}
+
+static void pm_dump_model_bin(pm_Peripheral *plist) {
+    // best effort, model is still loaded from JSON next time upon failure
+    pm_ModelBinHdr *hdr;
+    struct stat json_st;
+    pm_Peripheral *peri;
+    uint32_t peri_num = 0, ret_num = 0;
+    size_t ret_off, sz;
+    char *buf, *bin, *tmp;
+    FILE *f;
+    int ok;
+
+    if (stat(model_if, &json_st) == -1)
+        return;
+
+    for (peri = plist; peri; peri = peri->next)
+        peri_num ++;
+    if (pm_model_bin_flags_needed() & PM_MODEL_BIN_SR_READ)
+        while (sr_func_ret_addr[ret_num])
+            ret_num ++;
+    ret_off = sizeof(pm_ModelBinHdr) + sizeof(pm_Peripheral) * peri_num;
+    sz = pm_model_bin_layout(plist, NULL, ret_off + sizeof(uint32_t) * ret_num);
+
+    buf = g_malloc0(sz);
+    pm_model_bin_layout(plist, buf, ret_off + sizeof(uint32_t) * ret_num);
+    memcpy(buf + ret_off, sr_func_ret_addr, sizeof(uint32_t) * ret_num);
+
+    hdr = (pm_ModelBinHdr *)buf;
+    hdr->magic = PM_MODEL_BIN_MAGIC;
+    hdr->version = PM_MODEL_BIN_VERSION;
+    hdr->hdr_size = sizeof(pm_ModelBinHdr);
+    hdr->flags = pm_model_bin_flags_needed();
+    hdr->peri_size = sizeof(pm_Peripheral);
+    hdr->evt_size = sizeof(pm_Event);
+    hdr->reg_size = sizeof(pm_MMIORegister);
+    hdr->reg_cold_size = sizeof(pm_MMIORegCold);
+    hdr->json_size = json_st.st_size;
+    hdr->json_mtime_ns = json_st.st_mtim.tv_sec * 1000000000LL +
+        json_st.st_mtim.tv_nsec;
+    hdr->peri_num = peri_num;
+    if (hdr->flags & PM_MODEL_BIN_SR_READ) {
+        hdr->srr_site = srr_site;
+        hdr->CR_SR_r_idx = CR_SR_r_idx_in_bbl;
+        hdr->target_bbl_cnt = target_bbl_cnt;
+        hdr->sr_func_ret_num = ret_num;
+    }
+    if (hdr->flags & PM_MODEL_BIN_AUP)
+        hdr->replay_bbl_cnt = replay_bbl_cnt;
+
+    // written into tmp file and renamed, concurrent QEMUs never see half of it
+    bin = pm_model_bin_path();
+    tmp = g_strdup_printf("%s.%d", bin, getpid());
+    f = fopen(tmp, "wb");
+    if (f) {
+        ok = fwrite(buf, sz, 1, f) == 1;
+        if (fclose(f) || !ok || rename(tmp, bin))
+            unlink(tmp);
+    }
+    g_free(buf);
+    g_free(tmp);
+    g_free(bin);
+}
+
+int pm_load_model(pm_Peripheral **pm_PList) {
+    // returns 0/-1/-2 on success/json loading error/too many XX or conversion error
+    pm_Peripheral *plist;
+    int status;
+
+    if (pm_load_model_bin(&plist)) {
+        status = pm_load_model_json(&plist);
+        if (status)
+            return status;
+        pm_dump_model_bin(plist);
+    }
+
+    if (aflFile && pm_stage == SR_R_EXPLORE) {
+        if (target_bbl_cnt <= replay_bbl_cnt)
+          // For SMR, replay must stop before executing the BBL reading SR, 
+          // so that after executing the BBL, it can start stage 2, i.e. 
+          // set expl_started to 1. SMR may start before replay finish, e.g. 
+          // due to cr_ins which deletes all SM for a peripheral. 
+          // We gurantee replay finishes in time by: 
+          replay_bbl_cnt = target_bbl_cnt - 1;
+    }
+
+    *pm_PList = plist;
+    for (; plist; plist = plist->next) {
+        pm_peri_table_insert(plist);
+        pm_peri_map(plist);
+    }
+    return 0;
+}
+
+
+pm_Peripheral *pm_reload_model(const char *path) {
     // free previously loaded model
     pm_Peripheral *p = pm_PeripheralList, *q;
     while(p) {
         q = p->next;
-        g_free(p);
+        // parts in binary model are freed by munmap below
+        pm_free_peri(p);
         p = q;
     }
     pm_PeripheralList = NULL;
+    pm_peri_table_reset();
+    if (pm_model_bin_mm) {
+        munmap(pm_model_bin_mm, pm_model_bin_sz);
+        pm_model_bin_mm = NULL;
+    }
 
     // load model from file again
-    static char model_if_buf[80];
+    // keep a copy, path may be a scratch buffer of the caller
+    static char model_if_buf[PM_MODEL_PATH_MAX];
+    snprintf(model_if_buf, sizeof(model_if_buf), "%s", path);
     model_if = model_if_buf;
-    snprintf(model_if, 80, "%d/peripheral_model.json", run_num);
     if (pm_load_model(&p)) {
         fprintf(stderr, "Fail to reload model from file %s!\n", model_if);
         exit(0x76);
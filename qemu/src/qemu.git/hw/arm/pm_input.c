@@ -0,0 +1,125 @@
+#include "peri-mod/input.h"
+#include <sys/mman.h>
+
+pm_eoi_t pm_eoi = PM_EOI_EXIT;
+pm_Input pm_in;
+
+int pm_eoi_parse(const char *str) {
+    // returns 0 on success, -1 otherwise
+    static const char *names[] = {"exit", "zero", "wrap"};
+    int i;
+    for (i = 0; i < 3; i ++)
+        if (!strcmp(str, names[i])) {
+            pm_eoi = i;
+            return 0;
+        }
+    return -1;
+}
+
+// split testcase into streams, see peri-mod/input.h for the format
+static void pm_input_parse(void) {
+    const unsigned char *p = pm_in.buf, *end = pm_in.buf + pm_in.len;
+    size_t magic_len = sizeof(PM_INPUT_STREAM_MAGIC) - 1;
+    pm_InputStream *s;
+    uint32_t key, len;
+
+    memset(pm_in.streams, 0, sizeof(pm_in.streams));
+    memset(pm_in.dr, 0, sizeof(pm_in.dr));
+    pm_in.stream_num = 1;
+    pm_in.dr_num = 0;
+    pm_in.streams[0].buf = p;
+
+    if (pm_in.len < magic_len || memcmp(p, PM_INPUT_STREAM_MAGIC, magic_len)) {
+        // single default stream
+        pm_in.streams[0].len = pm_in.len;
+        return;
+    }
+
+    p += magic_len;
+    while (end - p >= 8) {
+        key = ldl_le_p(p);
+        len = ldl_le_p(p + 4);
+        p += 8;
+        if (len > end - p)
+            len = end - p;
+
+        if (!key)
+            s = &pm_in.streams[0];
+        else if (pm_in.stream_num <= PM_INPUT_MAX_STREAMS)
+            s = &pm_in.streams[pm_in.stream_num ++];
+        else
+            s = NULL; // too many streams, ignored
+        if (s) {
+            s->key = key;
+            s->buf = p;
+            s->len = len;
+        }
+        p += len;
+    }
+}
+
+int pm_input_open(void) {
+    // returns 0 on success, -1 otherwise
+    struct stat sb;
+    void *mm;
+    int fd;
+
+    if (pm_input) {
+        // testcase in shm from afl-fuzz
+        pm_in.buf = pm_input->buf;
+        pm_in.len = pm_input->len;
+        pm_input_parse();
+        return 0;
+    }
+
+    fd = open(aflFile, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (fstat(fd, &sb) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if (sb.st_size) {
+        // never unmapped, worker exits when done
+        mm = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mm == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+    } else {
+        mm = "";
+    }
+    close(fd);
+
+    pm_in.buf = mm;
+    pm_in.len = sb.st_size;
+    pm_input_parse();
+    return 0;
+}
+
+// bind DR register key to its stream, slot is its empty slot in pm_in.dr
+pm_InputStream *pm_input_stream_add(uint32_t key, unsigned slot) {
+    pm_InputStream *s = &pm_in.streams[0];
+    int i;
+
+    for (i = 1; i < pm_in.stream_num; i ++)
+        if (pm_in.streams[i].key == key) {
+            s = &pm_in.streams[i];
+            break;
+        }
+
+    // beyond PM_INPUT_MAX_STREAMS, DR registers are not bound or reported
+    if (pm_in.dr_num >= PM_INPUT_MAX_STREAMS)
+        return s;
+    pm_in.dr[slot].key = key;
+    pm_in.dr[slot].s = s;
+    pm_in.dr_num ++;
+
+    if (pm_input)
+        pm_input->keys[pm_input->key_num ++] = key;
+    return s;
+}
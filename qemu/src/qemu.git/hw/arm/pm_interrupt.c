@@ -1,12 +1,15 @@
 #include "peri-mod/peri-mod.h"
 #include "peri-mod/interrupt.h"
+#include "qemu/host-utils.h"
+
+unsigned int pm_int_period = FUZZING_INT_FREQ;
 
 void pm_enable_interrupt(int excp_num) {
     int i;
     for (i = 0; i < pm_interrupt->arr_size; i ++) {
       // exception number of NVIC instead of GIC is stored
       if (pm_interrupt->arr[i].int_num == excp_num) {
-        pm_interrupt->arr[i].enabled = 1;
+        pm_interrupt->enabled |= 1U << i;
         break;
       }
     }
@@ -20,7 +23,7 @@ void pm_enable_interrupt(int excp_num) {
       } else {
         // Store exception number of NVIC instead of GIC
         pm_interrupt->arr[pm_interrupt->arr_size].int_num = excp_num;
-        pm_interrupt->arr[pm_interrupt->arr_size ++].enabled = 1;
+        pm_interrupt->enabled |= 1U << pm_interrupt->arr_size ++;
 
         qemu_log_mask(CPU_LOG_INT, "bbl_cnt %d: Enabled IRQ %d\n",
           bbl_cnt, excp_num-16);
@@ -33,7 +36,7 @@ void pm_disable_interrupt(int excp_num) {
     for (i = 0; i < pm_interrupt->arr_size; i ++) {
       // exception number of NVIC instead of GIC is stored
       if (pm_interrupt->arr[i].int_num == excp_num) {
-        pm_interrupt->arr[i].enabled = 0;
+        pm_interrupt->enabled &= ~(1U << i);
 
         qemu_log_mask(CPU_LOG_INT, "bbl_cnt %d: Disabled IRQ %d\n",
           bbl_cnt, excp_num-16);
@@ -50,30 +53,32 @@ void pm_disable_interrupt(int excp_num) {
 
 // Round robin interrupt firing
 void pm_fire_interrupt(void) {
-    int excp_num;
-    int i, idx;
+    uint32_t en = pm_interrupt->enabled;
+    int size = pm_interrupt->arr_size;
+    int cur = pm_interrupt->cur_int;
+    int excp_num, idx;
 
-    for (i = 0; i < pm_interrupt->arr_size; i ++) {
-      idx = (pm_interrupt->cur_int + i) % pm_interrupt->arr_size;
-      if (idx == (pm_interrupt->arr_size - 1)) {
-        // XXX During ME, there might be one interrupt fired INT_ROUND+1 times
+    // 1st enabled in arr[cur_int..], then wrap around to arr[0..cur_int)
+    // int_round counts passes over the last entry, as a linear scan would
+    if (en >> cur) {
+      idx = ctz32(en >> cur) + cur;
+    } else {
+      // XXX During ME, there might be one interrupt fired INT_ROUND+1 times
+      if (size) int_round ++;
+      if (!en) {
+        qemu_log_mask(CPU_LOG_INT, "bbl_cnt %d: No IRQ is enabled\n", bbl_cnt);
         int_round ++;
+        return;
       }
+      idx = ctz32(en);
+    }
+    if (idx == size - 1) int_round ++;
 
-      if (pm_interrupt->arr[idx].enabled) {
-        excp_num = pm_interrupt->arr[idx].int_num;
-        cortexm_nvic_set_pending(pm_interrupt->s, excp_num);
-
-        qemu_log_mask(CPU_LOG_INT, "bbl_cnt %d: Fired IRQ %d\n",
-          bbl_cnt, excp_num-16);
+    excp_num = pm_interrupt->arr[idx].int_num;
+    cortexm_nvic_set_pending(pm_interrupt->s, excp_num);
 
-        pm_interrupt->cur_int = (idx + 1) % pm_interrupt->arr_size;
-        break;
-      }
-    }
+    qemu_log_mask(CPU_LOG_INT, "bbl_cnt %d: Fired IRQ %d\n",
+      bbl_cnt, excp_num-16);
 
-    if (i == pm_interrupt->arr_size) {
-      qemu_log_mask(CPU_LOG_INT, "bbl_cnt %d: No IRQ is enabled\n", bbl_cnt);
-      int_round ++;
-    }
+    pm_interrupt->cur_int = (idx + 1) % size;
 }
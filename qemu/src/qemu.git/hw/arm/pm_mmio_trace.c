@@ -0,0 +1,36 @@
+#include "peri-mod/mmio-trace.h"
+#include <sys/mman.h>
+
+pm_TraceHdr *pm_trace = NULL;
+
+int pm_trace_open(const char *fname) {
+    // returns 0 on success, -1 otherwise
+    size_t sz = sizeof(pm_TraceHdr) + sizeof(pm_TraceRec) * PM_TRACE_REC_NUM;
+    void *mm;
+    int fd;
+
+    fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (ftruncate(fd, sz) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    mm = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mm == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    pm_trace = mm;
+    pm_trace->magic = PM_TRACE_MAGIC;
+    pm_trace->version = PM_TRACE_VERSION;
+    pm_trace->rec_size = sizeof(pm_TraceRec);
+    pm_trace->rec_num = PM_TRACE_REC_NUM;
+    pm_trace->head = 0;
+    return 0;
+}
@@ -0,0 +1,252 @@
+#include "peri-mod/snapshot.h"
+#include "peri-mod/interrupt.h"
+#include "peri-mod/input.h"
+#include "afl/afl.h"
+#include "exec/exec-all.h"
+#include "translate-all.h"
+#include "exec/ram_addr.h"
+#include "qemu/timer.h"
+#include "hw/arm/cortexm-mcu.h"
+#include "hw/intc/cortexm-nvic.h"
+#include <signal.h>
+
+unsigned int pm_persist = 0;
+
+// registers up to the TLB, which stays valid as memory map is not changed
+#define PM_SNAP_ENV_SIZE offsetof(CPUARMState, tlb_table)
+// GIC state besides QOM object, IRQ lines and MRs
+#define PM_SNAP_GIC_START offsetof(GICState, ctlr)
+#define PM_SNAP_GIC_SIZE (offsetof(GICState, iomem) - PM_SNAP_GIC_START)
+#define PM_SYSTICK_ENABLE 1 // SYSTICK_ENABLE of cortexm-nvic.c
+
+#define PM_SNAP_RAM_NUM 4 // sram, sram2, sram3, hack
+
+typedef struct {
+    MemoryRegion *mr;
+    unsigned char *host; // guest RAM
+    unsigned char *copy;
+    ram_addr_t ram_addr;
+    uint64_t size;
+} pm_RamSnap;
+
+typedef struct {
+    pm_Peripheral *peri;
+    int reg_num;
+    pm_MMIORegister *regs;
+    pm_MMIORegCold *regs_cold;
+    pm_Event *events;
+    uint32_t cr_key;
+    int cr_num;
+} pm_PeriSnap;
+
+static struct {
+    CPUState *cpu; // NULL until taken
+    CPUARMState env;
+    uint32_t interrupt_request;
+    uint32_t halted;
+
+    CortexMNVICState *nvic;
+    GICState gic;
+    uint32_t systick_control, systick_reload;
+    int64_t systick_tick;
+    pm_Interrupt interrupt;
+
+    pm_RamSnap ram[PM_SNAP_RAM_NUM];
+    int ram_num;
+
+    pm_PeriSnap *peri;
+    int peri_num;
+
+    unsigned int bbl_cnt;
+    uint32_t bbl_started;
+    int int_countdown;
+    uint32_t bbl_s, bbl_e;
+    int int_round;
+    int consec_same_reg_r;
+    int SR_r_num;
+} snap;
+
+static void pm_snapshot_ram(MemoryRegion *mr) {
+    pm_RamSnap *r = &snap.ram[snap.ram_num ++];
+
+    r->host = memory_region_get_ram_ptr(mr);
+    r->ram_addr = memory_region_get_ram_addr(mr);
+    r->size = memory_region_size(mr);
+    r->copy = g_malloc(r->size);
+    memcpy(r->copy, r->host, r->size);
+    r->mr = mr;
+
+    // 1st write to each page from now on goes through notdirty_mem_write,
+    // which marks it dirty and puts the fast path back into the TLB
+    memory_region_set_log(mr, true, DIRTY_MEMORY_VGA);
+    memory_region_reset_dirty(mr, 0, r->size, DIRTY_MEMORY_VGA);
+}
+
+void pm_snapshot_take(CPUState *cpu) {
+    extern CortexMState *cs_g;
+    CPUARMState *env = cpu->env_ptr;
+    CortexMNVICState *s = pm_interrupt->s;
+    pm_Peripheral *peri;
+    pm_PeriSnap *p;
+    int n;
+
+    memcpy(&snap.env, env, PM_SNAP_ENV_SIZE);
+    snap.interrupt_request = cpu->interrupt_request;
+    snap.halted = cpu->halted;
+
+    snap.nvic = s;
+    memcpy((char *)&snap.gic + PM_SNAP_GIC_START,
+        (char *)&s->gic + PM_SNAP_GIC_START, PM_SNAP_GIC_SIZE);
+    snap.systick_control = s->systick.control;
+    snap.systick_reload = s->systick.reload;
+    snap.systick_tick = s->systick.tick;
+    snap.interrupt = *pm_interrupt;
+
+    pm_snapshot_ram(&cs_g->sram_mem);
+    if (cs_g->sram_size_kb2)
+        pm_snapshot_ram(&cs_g->sram_mem2);
+    if (cs_g->sram_size_kb3)
+        pm_snapshot_ram(&cs_g->sram_mem3);
+    pm_snapshot_ram(&cs_g->hack_mem);
+
+    for (n = 0, peri = pm_PeripheralList; peri; peri = peri->next)
+        n ++;
+    snap.peri = g_new0(pm_PeriSnap, n);
+    snap.peri_num = n;
+    for (p = snap.peri, peri = pm_PeripheralList; peri; peri = peri->next, p ++) {
+        p->peri = peri;
+        p->reg_num = MIN(peri->max_reg_idx + 1, peri->reg_cap);
+        p->regs = g_memdup(peri->regs, sizeof(pm_MMIORegister) * p->reg_num);
+        p->regs_cold = g_memdup(peri->regs_cold,
+            sizeof(pm_MMIORegCold) * p->reg_num);
+        p->events = g_memdup(peri->events, sizeof(pm_Event) * peri->evt_num);
+        p->cr_key = peri->cr_key;
+        p->cr_num = peri->cr_num;
+    }
+
+    snap.bbl_cnt = bbl_cnt;
+    snap.bbl_started = pm_bbl_started;
+    snap.int_countdown = pm_int_countdown;
+    snap.bbl_s = cur_bbl_s;
+    snap.bbl_e = cur_bbl_e;
+    snap.int_round = int_round;
+    snap.consec_same_reg_r = consec_same_reg_r;
+    snap.SR_r_num = cur_bbl_SR_r_num;
+
+    snap.cpu = cpu;
+}
+
+// copies back only the pages written since the last restore,
+// returns # of them
+static unsigned int pm_snapshot_restore_ram(pm_RamSnap *r) {
+    unsigned long *dirty = ram_list.dirty_memory[DIRTY_MEMORY_VGA];
+    unsigned long end = (r->ram_addr + r->size + TARGET_PAGE_SIZE - 1)
+        >> TARGET_PAGE_BITS;
+    unsigned long page = r->ram_addr >> TARGET_PAGE_BITS;
+    unsigned int n = 0;
+    uint64_t off, len;
+
+    while ((page = find_next_bit(dirty, end, page)) < end) {
+        off = ((ram_addr_t)page << TARGET_PAGE_BITS) - r->ram_addr;
+        len = MIN(TARGET_PAGE_SIZE, r->size - off);
+        memcpy(r->host + off, r->copy + off, len);
+        // code translated from the page after it was written is stale
+        tb_invalidate_phys_range(r->ram_addr + off, r->ram_addr + off + len);
+        page ++;
+        n ++;
+    }
+    // restore itself is not a write, memcpy bypasses dirty logging
+    if (n)
+        memory_region_reset_dirty(r->mr, 0, r->size, DIRTY_MEMORY_VGA);
+
+    return n;
+}
+
+// returns # of RAM pages restored
+static unsigned int pm_snapshot_restore(void) {
+    CPUState *cpu = snap.cpu;
+    CortexMNVICState *s = snap.nvic;
+    pm_Peripheral *peri;
+    pm_PeriSnap *p;
+    unsigned int pages = 0;
+    int i;
+
+    memcpy(cpu->env_ptr, &snap.env, PM_SNAP_ENV_SIZE);
+    cpu->interrupt_request = snap.interrupt_request;
+    cpu->halted = snap.halted;
+    cpu->exception_index = -1;
+
+    memcpy((char *)&s->gic + PM_SNAP_GIC_START,
+        (char *)&snap.gic + PM_SNAP_GIC_START, PM_SNAP_GIC_SIZE);
+    s->systick.control = snap.systick_control;
+    s->systick.reload = snap.systick_reload;
+    s->systick.tick = snap.systick_tick;
+    if (s->systick.control & PM_SYSTICK_ENABLE)
+        timer_mod(s->systick.timer, s->systick.tick);
+    else
+        timer_del(s->systick.timer);
+    *pm_interrupt = snap.interrupt;
+    // IRQ line to CPU follows restored NVIC state
+    gic_update(&s->gic);
+
+    for (i = 0; i < snap.ram_num; i ++)
+        pages += pm_snapshot_restore_ram(&snap.ram[i]);
+
+    for (p = snap.peri; p < snap.peri + snap.peri_num; p ++) {
+        peri = p->peri;
+        memcpy(peri->regs, p->regs, sizeof(pm_MMIORegister) * p->reg_num);
+        memcpy(peri->regs_cold, p->regs_cold,
+            sizeof(pm_MMIORegCold) * p->reg_num);
+        if (peri->max_reg_idx >= p->reg_num) {
+            // accessed the 1st time by this testcase
+            memset(peri->regs + p->reg_num, 0, sizeof(pm_MMIORegister) *
+                (peri->max_reg_idx + 1 - p->reg_num));
+            memset(peri->regs_cold + p->reg_num, 0, sizeof(pm_MMIORegCold) *
+                (peri->max_reg_idx + 1 - p->reg_num));
+            peri->max_reg_idx = p->reg_num - 1;
+        }
+        memcpy(peri->events, p->events, sizeof(pm_Event) * peri->evt_num);
+        peri->cr_key = p->cr_key;
+        peri->cr_num = p->cr_num;
+    }
+
+    bbl_cnt = snap.bbl_cnt;
+    pm_bbl_started = snap.bbl_started;
+    pm_int_countdown = snap.int_countdown;
+    cur_bbl_s = snap.bbl_s;
+    cur_bbl_e = snap.bbl_e;
+    int_round = snap.int_round;
+    consec_same_reg_r = snap.consec_same_reg_r;
+    cur_bbl_SR_r_num = snap.SR_r_num;
+    // counters are restored, cpu_exec must not undo the aborted BBL
+    pm_tb_running = 0;
+
+    // reopened by 1st DR read of next testcase
+    pm_in.buf = NULL;
+    afl_prev_loc = 0;
+    aflGotLog = 0;
+
+    return pages;
+}
+
+void pm_snapshot_next(void) {
+    static unsigned int execs;
+    unsigned int pages;
+    int64_t t;
+
+    if (!snap.cpu || ++ execs >= pm_persist)
+        return;
+
+    t = get_clock();
+    pages = pm_snapshot_restore();
+    if (pm_input) {
+        pm_input->restore_pages = pages;
+        pm_input->restore_ns = get_clock() - t;
+    }
+    fflush(stdout);
+
+    // fork server resumes us with the next testcase
+    raise(SIGSTOP);
+    afl_fork_run();
+    cpu_loop_exit(snap.cpu);
+}
@@ -27,10 +27,14 @@
  */
 
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include "qemu/timer.h"
 #include "afl/afl.h"
 #include "afl/config.h"
 
 #include "peri-mod/peri-mod.h"
+#include "peri-mod/snapshot.h"
+#include "hw/arm/cortexm-mcu.h"
 
 /***************************
  * VARIOUS AUXILIARY STUFF *
@@ -49,24 +53,26 @@
    _start and does the usual forkserver stuff, not very different from
    regular instrumentation injected via afl-as.h. */
 
-#define AFL_QEMU_CPU_SNIPPET2(env, pc) do { \
-    if(pc == afl_entry_point && pc && getenv("AFLGETWORK") == 0) { \
+#define AFL_QEMU_CPU_SNIPPET2(env, tb) do { \
+    if(tb->pc == afl_entry_point && tb->pc && getenv("AFLGETWORK") == 0) { \
       afl_setup(); \
       afl_forkserver(env); \
       aflStart = 1; \
     } \
-    afl_maybe_log(pc); \
+    afl_maybe_log(tb); \
   } while (0)
 
-/* We use one additional file descriptor to relay "needs translation"
-   messages between the child and the fork server. */
-
-#define TSL_FD (FORKSRV_FD - 1)
-
 /* This is equivalent to afl-as.h: */
 
 static unsigned char *afl_area_ptr = 0;
 
+/* Bitmap and previous location used by the edge logging emitted into TBs,
+   see gen_aflBBlock(). Logs go to a scratch map until SHM is attached. */
+
+static unsigned char afl_area_scratch[MAP_SIZE];
+unsigned char *afl_tcg_area = afl_area_scratch;
+uint32_t afl_prev_loc;
+
 /* Exported variables populated by the code patched into elfload.c: */
 
 target_ulong afl_entry_point = 0, /* ELF entry point (_start) */
@@ -79,6 +85,14 @@ int aflGotLog = 0;              /* we've seen dmesg logging */
 
 /* from command line options */
 const char *aflFile = NULL;
+
+/* testcase delivered by afl-fuzz, replaces aflFile: */
+
+struct pm_input_shm *pm_input = NULL;
+
+/* models published by afl-fuzz, see afl_model_check(): */
+
+struct pm_model_registry *pm_model_reg = NULL;
 unsigned long aflPanicAddr = (unsigned long)-1;
 unsigned long aflDmesgAddr = (unsigned long)-1;
 
@@ -92,11 +106,17 @@ unsigned int afl_forksrv_pid;
 
 static unsigned int afl_inst_rms = MAP_SIZE;
 
+/* Live part of the map, see MAP_SIZE_MIN. afl_map_size is set by
+   -pm-map-size or 0, until afl_map_setup() settles it and the mask. */
+
+unsigned int afl_map_size;
+static unsigned int afl_map_mask;
+
 /* Function declarations. */
 
-static inline void afl_maybe_log(target_ulong);
+static inline void afl_maybe_log(TranslationBlock *);
 
-static void afl_wait_tsl(CPUArchState*, int);
+static void afl_mirror_tsl(CPUArchState*);
 static void afl_request_tsl(target_ulong, target_ulong, uint64_t);
 
 static TranslationBlock *tb_find_slow(CPUArchState*, target_ulong,
@@ -111,11 +131,44 @@ struct afl_tsl {
   uint64_t flags;
 };
 
+/* "Needs translation" messages are relayed from the child to the fork server
+   through memory shared for the fork server's whole life, instead of a pipe
+   set up for every exec. The child appends, the fork server mirrors them
+   once the child has exited or stopped and resets the ring. */
+
+#define AFL_TSL_RING_SIZE 4096
+
+struct afl_tsl_ring {
+  uint32_t num;      /* requests made by the child, may exceed the ring */
+  int64_t run_ns;    /* get_clock() when the child started running */
+  struct afl_tsl req[AFL_TSL_RING_SIZE];
+};
+
+static struct afl_tsl_ring *afl_tsl_ring;
+
 
 /*************************
  * ACTUAL IMPLEMENTATION *
  *************************/
 
+/* Pick the map size, before the 1st block is hashed. */
+
+static void afl_map_setup(void) {
+
+  extern CortexMState *cs_g;
+  unsigned int want = afl_map_size;
+
+  if (!want) want = (cs_g->flash_size_kb << 10) / MAP_FLASH_RATIO;
+
+  for (afl_map_size = MAP_SIZE_MIN;
+       afl_map_size < want && afl_map_size < MAP_SIZE; afl_map_size <<= 1);
+
+  afl_map_mask = afl_map_size - 1;
+  afl_inst_rms = afl_map_size;
+
+}
+
+
 /* Set up SHM region and initialize other stuff. */
 
 void afl_setup(void) {
@@ -125,6 +178,8 @@ void afl_setup(void) {
 
   int shm_id;
 
+  if (!afl_map_mask) afl_map_setup();
+
   if (inst_r) {
 
     unsigned int r;
@@ -134,7 +189,7 @@ void afl_setup(void) {
     if (r > 100) r = 100;
     if (!r) r = 1;
 
-    afl_inst_rms = MAP_SIZE * r / 100;
+    afl_inst_rms = afl_map_size * r / 100;
 
   }
 
@@ -150,6 +205,7 @@ void afl_setup(void) {
 
     if (inst_r) afl_area_ptr[0] = 1;
 
+    afl_tcg_area = afl_area_ptr;
 
   }
 
@@ -160,6 +216,62 @@ void afl_setup(void) {
 
   }
 
+  id_str = getenv(PM_INPUT_SHM_ENV_VAR);
+
+  if (id_str) {
+
+    pm_input = shmat(atoi(id_str), NULL, 0);
+
+    if (pm_input == (void*)-1) exit(1);
+
+    /* Tell afl-fuzz it can stop writing aflFile. */
+
+    pm_input->used = 1;
+
+  }
+
+  id_str = getenv(PM_MODEL_REG_ENV_VAR);
+
+  if (id_str) {
+
+    int fd = open(id_str, O_RDONLY);
+
+    if (fd < 0) exit(1);
+
+    pm_model_reg = mmap(NULL, sizeof(struct pm_model_registry), PROT_READ,
+                        MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (pm_model_reg == MAP_FAILED) exit(1);
+
+  }
+
+}
+
+
+/* Check the model registry, once per fork. If a newer model is published,
+   copy its path, making sure that it was not being rewritten meanwhile, and
+   return the generation; otherwise return 0. */
+
+static unsigned int afl_model_check(unsigned int cur_gen, char *path) {
+
+  unsigned int gen;
+
+  if (!pm_model_reg) return 0;
+
+  gen = pm_model_reg->generation;
+
+  if (gen == cur_gen || (gen & 1)) return 0;
+
+  __sync_synchronize();
+  memcpy(path, pm_model_reg->path, PM_MODEL_PATH_MAX);
+  path[PM_MODEL_PATH_MAX - 1] = 0;
+  __sync_synchronize();
+
+  if (pm_model_reg->generation != gen) return 0;
+
+  return gen;
+
 }
 
 static ssize_t uninterrupted_read(int fd, void *buf, size_t cnt)
@@ -170,132 +282,128 @@ static ssize_t uninterrupted_read(int fd, void *buf, size_t cnt)
     return n;
 }
 
-int run_num = 1;
-
 /* Fork server logic, invoked once we hit _start. */
 
 void afl_forkserver(CPUArchState *env) {
 
-  static unsigned char tmp[4];
-
   if (!afl_area_ptr) return;
 
-  /* Tell the parent that we're alive. If the parent doesn't want
-     to talk, assume that we're not running in forkserver mode. */
+  /* Tell the parent that we're alive, and how much of the map we use. If
+     the parent doesn't want to talk, assume that we're not running in
+     forkserver mode. */
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (write(FORKSRV_FD + 1, &afl_map_size, 4) != 4) return;
 
   afl_forksrv_pid = getpid();
 
+  afl_tsl_ring = mmap(NULL, sizeof(struct afl_tsl_ring),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                      -1, 0);
+  if (afl_tsl_ring == MAP_FAILED) exit(3);
+
   /* All right, let's await orders... */
 
   while (1) {
 
-    pid_t child_pid;
-    int status, t_fd[2];
+    static pid_t child_pid;
+    static int child_stopped;
+    static unsigned int model_gen;
+    char model_path[PM_MODEL_PATH_MAX];
+    unsigned int gen;
+    int status, was_killed;
+    int64_t fork_ns;
 
     /* Whoops, parent dead? */
 
-    if (uninterrupted_read(FORKSRV_FD, tmp, 4) != 4) exit(2);
+    if (uninterrupted_read(FORKSRV_FD, &was_killed, 4) != 4) exit(2);
 
-    /* Establish a channel with child to grab translation commands. We'll 
-       read from t_fd[0], child will write to TSL_FD. */
+    /* With -pm-persist, the child stops itself after a testcase. If it was
+       killed on timeout right after, it's a zombie to reap, not to resume. */
 
-    if (pipe(t_fd) || dup2(t_fd[1], TSL_FD) < 0) exit(3);
-    close(t_fd[1]);
+    if (child_stopped && was_killed) {
+      child_stopped = 0;
+      if (waitpid(child_pid, &status, 0) < 0) exit(8);
+    }
 
-    child_pid = fork();
-    if (child_pid < 0) exit(4);
+    /* afl-fuzz instances run ME in the background and publish each model
+       they get in the registry. Switch to it before the next child, which a
+       stopped child would not see. me.py has built its binary form, so this
+       is an mmap rather than a parse. A model being rewritten is picked up
+       on a later fork. */
+
+    if ((gen = afl_model_check(model_gen, model_path))) {
+      if (child_stopped) {
+        child_stopped = 0;
+        kill(child_pid, SIGKILL);
+        if (waitpid(child_pid, &status, 0) < 0) exit(8);
+      }
+      model_gen = gen;
+      pm_PeripheralList = pm_reload_model(model_path);
+    }
 
-    if (!child_pid) {
+    fork_ns = get_clock();
 
-      /* Child process. Close descriptors and run free. */
+    if (!child_stopped) {
 
-      afl_fork_child = 1;
-      close(FORKSRV_FD);
-      close(FORKSRV_FD + 1);
-      close(t_fd[0]);
-      return;
+      child_pid = fork();
+      if (child_pid < 0) exit(4);
 
-    }
+      if (!child_pid) {
 
-    /* Parent. */
+        /* Child process. Close descriptors and run free. */
 
-    close(TSL_FD);
+        afl_fork_child = 1;
+        afl_prev_loc = 0;
+        close(FORKSRV_FD);
+        close(FORKSRV_FD + 1);
+        return;
 
-    if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) exit(5);
+      }
 
-    /* Collect translation requests until child dies and closes the pipe. */
+    } else {
 
-    afl_wait_tsl(env, t_fd[0]);
+      /* Resume the child with the next testcase. */
 
-    /* Get and relay exit status to parent. */
+      child_stopped = 0;
+      if (kill(child_pid, SIGCONT) < 0) exit(4);
 
-    if (waitpid(child_pid, &status, 0) < 0) exit(6);
+    }
 
-    if (write(FORKSRV_FD + 1, &status, 4) != 4) exit(7);
+    if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) exit(5);
+
+    /* Get and relay exit status to parent. The child only stops after a
+       testcase that ended in doneWork(0), with -pm-persist. */
 
-    if (WIFEXITED(status) && (WEXITSTATUS(status) == PM_UNCAT_REG || 
-        WEXITSTATUS(status) == PM_UNMOD_SRRS)) {
-        // Fuzzer run terminated by access to unmodeled peripheral
-        pid_t me_pid;
-        int me_status;
-
-        // timer in AFL is stopped by write(FORKSRV_FD + 1, &status, 4)
-
-        // run me.py
-        me_pid = fork();
-        if (me_pid < 0) exit(4);
-        if (!me_pid) {
-            // Child
-            char run_num_str[8];
-            snprintf(run_num_str, 8, "%d", run_num);
-            char *argv[] = {me_bin, "--config", me_config, 
-                "--run-num", run_num_str, "--print-to-file", 
-                "--run-from-forkserver", 
-                // worker dumps access to unmodeled peri into model_if
-                "--afl-file", aflFile, "--model-if", model_if, NULL};
-            execv(me_bin, argv);
-        } else {
-            // Parent
-            if (waitpid(me_pid, &me_status, 0) < 0) exit(6);
-
-            pm_PeripheralList = pm_reload_model();
-            run_num ++;
-
-            // notify AFL me.py exits
-            status = PM_ME_EXIT;
-            if (write(FORKSRV_FD + 1, &status, 4) != 4) exit(7);
-
-            // afl will instruct fork server to rerun the terminated fuzzer run
-        }
+    if (waitpid(child_pid, &status, pm_persist ? WUNTRACED : 0) < 0) exit(6);
+
+    if (WIFSTOPPED(status)) {
+      child_stopped = 1;
+      status = 0;
     }
-  }
 
-}
+    if (pm_input) {
+      pm_input->tsl_num = afl_tsl_ring->num;
+      if (afl_tsl_ring->run_ns)
+        pm_input->fork_ns = afl_tsl_ring->run_ns - fork_ns;
+    }
 
-static inline target_ulong aflHash(target_ulong cur_loc)
-{
-  if(!aflStart)
-    return 0;
+    if (write(FORKSRV_FD + 1, &status, 4) != 4) exit(7);
 
-  /* Optimize for cur_loc > afl_end_code, which is the most likely case on
-     Linux systems. */
+    /* Translate what the child had to, while afl-fuzz looks at the run,
+       so that the next fork() has it cached. */
 
-  if (cur_loc > afl_end_code || cur_loc < afl_start_code || !afl_area_ptr)
-    return 0;
+    afl_mirror_tsl(env);
 
-#ifdef DEBUG_EDGES
-  if(1) {
-    printf("exec %lx\n", cur_loc);
-    fflush(stdout);
   }
-#endif
 
-  /* Looks like QEMU always maps to fixed locations, so ASAN is not a
-     concern. Phew. But instruction addresses may be aligned. Let's mangle
-     the value to get something quasi-uniform. */
+}
+
+/* Looks like QEMU always maps to fixed locations, so ASAN is not a
+   concern. Phew. But instruction addresses may be aligned. Let's mangle
+   the value to get something quasi-uniform. */
 
+static inline target_ulong aflHash(target_ulong cur_loc)
+{
   target_ulong h = cur_loc;
 #if TARGET_LONG_BITS == 32
   h ^= cur_loc >> 16;
@@ -311,29 +419,69 @@ static inline target_ulong aflHash(target_ulong cur_loc)
   h ^= h >> 33;
 #endif
 
-  h &= MAP_SIZE - 1;
+  return h & afl_map_mask;
+}
+
+/* Hash the block and decide whether it is instrumented once, when it is
+   translated, so that logging it is one XOR and one increment. Blocks
+   translated before fuzzing starts skip the code range check, as
+   startForkserver() only sets the range then. */
+
+void afl_tb_loc(struct TranslationBlock *tb)
+{
+  target_ulong pc = tb->pc;
+
+  if (unlikely(!afl_map_mask)) afl_map_setup();
+
+  tb->afl_loc = aflHash(pc);
 
   /* Implement probabilistic instrumentation by looking at scrambled block
      address. This keeps the instrumented locations stable across runs. */
 
-  if (h >= afl_inst_rms) return 0;
-  return h;
+  tb->afl_inst = tb->afl_loc < afl_inst_rms &&
+                 (!aflStart || (pc >= afl_start_code && pc <= afl_end_code));
+}
+
+/* Sparse coverage for afl-fuzz, see PM_EDGE_LIST_MAX. Called whenever a map
+   slot goes from 0 to 1. edge_num stops one past the list to flag overflow. */
+
+void afl_edge_new(uint32_t idx) {
+
+  uint32_t n;
+
+  if (!pm_input || !pm_input->edge_log || afl_tcg_area != afl_area_ptr)
+    return;
+
+  n = pm_input->edge_num;
+  if (n > PM_EDGE_LIST_MAX) return;
+
+  if (n < PM_EDGE_LIST_MAX) pm_input->edges[n] = idx;
+  pm_input->edge_num = n + 1;
+
 }
 
-/* todo: generate calls to helper_aflMaybeLog during translation */
+/* Stage FUZZING emits the equivalent TCG ops instead, see gen_aflBBlock() */
 static inline void helper_aflMaybeLog(target_ulong cur_loc) {
-  static __thread target_ulong prev_loc;
+  uint32_t idx = cur_loc ^ afl_prev_loc;
 
-  afl_area_ptr[cur_loc ^ prev_loc]++;
-  prev_loc = cur_loc >> 1;
+  if (++afl_tcg_area[idx] == 1) afl_edge_new(idx);
+  afl_prev_loc = cur_loc >> 1;
 }
 
 /* The equivalent of the tuple logging routine from afl-as.h. */
 
-static inline void afl_maybe_log(target_ulong cur_loc) {
-  cur_loc = aflHash(cur_loc);
-  if(cur_loc)
-    helper_aflMaybeLog(cur_loc);
+static inline void afl_maybe_log(TranslationBlock *tb) {
+  if (!aflStart || !tb->afl_inst)
+    return;
+
+#ifdef DEBUG_EDGES
+  if(1) {
+    printf("exec %lx\n", tb->pc);
+    fflush(stdout);
+  }
+#endif
+
+  helper_aflMaybeLog(tb->afl_loc);
 }
 
 
@@ -344,58 +492,76 @@ static inline void afl_maybe_log(target_ulong cur_loc) {
 
 static void afl_request_tsl(target_ulong pc, target_ulong cb, uint64_t flags) {
 
-  struct afl_tsl t;
+  uint32_t n;
 
   if (!afl_fork_child) return;
 
-  t.pc      = pc;
-  t.cs_base = cb;
-  t.flags   = flags;
+  n = afl_tsl_ring->num;
 
-  if (write(TSL_FD, &t, sizeof(struct afl_tsl)) != sizeof(struct afl_tsl))
-    return;
+  /* When the ring is full, the request is only counted. The entry must be
+     complete before num covers it, the child may be killed any time. */
+
+  if (n < AFL_TSL_RING_SIZE) {
+    afl_tsl_ring->req[n].pc      = pc;
+    afl_tsl_ring->req[n].cs_base = cb;
+    afl_tsl_ring->req[n].flags   = flags;
+    smp_wmb();
+  }
+
+  afl_tsl_ring->num = n + 1;
 
 }
 
 
-/* This is the other side of the same channel. Since timeouts are handled by
-   afl-fuzz simply killing the child, we can just wait until the pipe breaks. */
+/* Called by the child when it starts or resumes running a testcase, for
+   fork-to-run latency. */
 
-static void afl_wait_tsl(CPUArchState *env, int fd) {
+void afl_fork_run(void) {
 
-  struct afl_tsl t;
+  if (afl_fork_child) afl_tsl_ring->run_ns = get_clock();
 
-  while (1) {
+}
 
-    /* Broken pipe means it's time to return to the fork server routine. */
 
-    if (read(fd, &t, sizeof(struct afl_tsl)) != sizeof(struct afl_tsl))
-      break;
+#ifndef CONFIG_USER_ONLY
 
-    if(0 && env) {
-#ifdef CONFIG_USER_ONLY
-        tb_find_slow(env, t.pc, t.cs_base, t.flags);
-#else
-        /* if the child system emulator pages in new code and then JITs it, 
-        and sends its address to the server, the server cannot also JIT it 
-        without having it's guest's kernel page the data in !  
-        so we will only JIT kernel code segment which shouldnt page.
-        */
-        // XXX this monstrosity must go!
-        if(t.pc >= 0xffffffff81000000 && t.pc <= 0xffffffff81ffffff) {
-            //printf("wait_tsl %lx -- jit\n", t.pc); fflush(stdout);
-            tb_find_slow(env, t.pc, t.cs_base, t.flags);
-        } else {
-            //printf("wait_tsl %lx -- ignore nonkernel\n", t.pc); fflush(stdout);
-        }
+/* The parent can only JIT code that it has the same copy of as the child.
+   MCU firmware runs from flash, which never changes, and from SRAM, where
+   code is copied to during init, i.e. before the fork server starts. */
+
+static int afl_tsl_addr_ok(target_ulong pc) {
+
+  return pm_code_addr_ok(pc);
+
+}
+
+#endif /* !CONFIG_USER_ONLY */
+
+
+/* This is the other side of the same channel, run once the child is gone or
+   stopped. */
+
+static void afl_mirror_tsl(CPUArchState *env) {
+
+  struct afl_tsl *t, *end;
+
+  end = afl_tsl_ring->req + MIN(afl_tsl_ring->num, AFL_TSL_RING_SIZE);
+
+  for (t = afl_tsl_ring->req; env && t < end; t++) {
+
+#ifndef CONFIG_USER_ONLY
+    if (!afl_tsl_addr_ok(t->pc)) continue;
 #endif
-    } else {
-        //printf("wait_tsl %lx -- ignore\n", t.pc); fflush(stdout);
-    }
+
+    /* Translate it here too, so that the next fork() has it cached. */
+
+    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+    tb_find_slow(env, t->pc, t->cs_base, t->flags);
+    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
   }
 
-  close(fd);
+  afl_tsl_ring->num = 0;
+  afl_tsl_ring->run_ns = 0;
 
 }
-
@@ -9,8 +9,14 @@ extern int aflGotLog;
 extern target_ulong afl_start_code, afl_end_code;
 extern unsigned char afl_fork_child;
 extern int afl_wants_cpu_to_stop;
+extern unsigned char *afl_tcg_area;
+extern uint32_t afl_prev_loc;
+
+void afl_tb_loc(struct TranslationBlock *);
+void afl_edge_new(uint32_t idx);
 
 void afl_setup(void);
 void afl_forkserver(CPUArchState*);
+void afl_fork_run(void);
 
 
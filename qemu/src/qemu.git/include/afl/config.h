@@ -310,6 +310,14 @@
 #define MAP_SIZE_POW2       21
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+/* P2IM: the map actually used is a power of 2 between MAP_SIZE_MIN and
+   MAP_SIZE, picked by QEMU (-pm-map-size, or one byte per MAP_FLASH_RATIO
+   bytes of MCU flash) and reported to afl-fuzz in the fork server hello.
+   0 in the hello means MAP_SIZE. */
+
+#define MAP_SIZE_MIN        (1 << 16)
+#define MAP_FLASH_RATIO     8
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC           0x40000000
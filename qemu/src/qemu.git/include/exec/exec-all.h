@@ -152,6 +152,14 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 
+    /* AFL bitmap location of this block and whether it is logged at all,
+       computed at translation time by afl_tb_loc() */
+    uint32_t afl_loc;
+    uint8_t afl_inst;
+    /* PC outside code regions of the MCU, the TB only terminates the run,
+       see gen_aflBBlock() */
+    uint8_t pm_illegal;
+
     void *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
     struct TranslationBlock *phys_hash_next;
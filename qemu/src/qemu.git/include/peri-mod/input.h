@@ -0,0 +1,111 @@
+#ifndef _PM_INPUT_H
+#define _PM_INPUT_H
+
+#include "peri-mod/peri-mod.h"
+#include "peri-mod/options.h" // pm_eoi_parse
+
+/*
+ * Streams of fuzzer input consumed by DR reads.
+ *
+ * Streams are read in place from the testcase: the shm filled by afl-fuzz
+ * (pm_input), or aflFile mmap'ed when QEMU is not run by afl-fuzz (replay
+ * in SR_R_ID/SR_R_EXPLORE, coverage tools). There is no cap on their
+ * length, firmware gets as many bytes as the testcase holds.
+ *
+ * Each DR register (keyed by its address) may have its own stream, so that
+ * how many bytes one peripheral consumes doesn't shift the bytes others see.
+ * A testcase starting with PM_INPUT_STREAM_MAGIC is a list of records:
+ *   uint32_t key, uint32_t len (little endian), len bytes
+ * key 0 is the default stream, read by DR registers without a record.
+ * Testcases without the magic are a single default stream. A truncated
+ * last record is cut short, so dropping the testcase's tail is harmless.
+ *
+ * What DR reads get past the end of their stream is decided by pm_eoi
+ * (-pm-eoi):
+ * - exit: terminate the run, as a normal exit (default)
+ * - zero: missing bytes read as 0, firmware keeps running
+ * - wrap: start over from the 1st byte of the stream
+ *
+ * Reported back to afl-fuzz in pm_input:
+ * - consumed: end offset in testcase of bytes read, so it can trim the rest
+ * - keys: DR registers read, so it can give them their own streams
+ */
+typedef enum {
+    PM_EOI_EXIT = 0,
+    PM_EOI_ZERO,
+    PM_EOI_WRAP,
+} pm_eoi_t;
+
+extern pm_eoi_t pm_eoi;
+
+typedef struct {
+    uint32_t key; // DR register address, 0 for default stream
+    const unsigned char *buf;
+    size_t len;
+    size_t pos; // next byte to read
+} pm_InputStream;
+
+#define PM_INPUT_DR_HASH_BITS 7 // at least twice PM_INPUT_MAX_STREAMS
+#define PM_INPUT_DR_HASH_SIZE (1 << PM_INPUT_DR_HASH_BITS)
+
+typedef struct {
+    const unsigned char *buf; // whole testcase, NULL until opened
+    size_t len;
+    // streams[0] is the default stream
+    pm_InputStream streams[PM_INPUT_MAX_STREAMS + 1];
+    int stream_num;
+    // DR register -> stream, open addressing, key 0 is empty slot
+    struct {
+        uint32_t key;
+        pm_InputStream *s;
+    } dr[PM_INPUT_DR_HASH_SIZE];
+    int dr_num;
+} pm_Input;
+
+extern pm_Input pm_in;
+int pm_input_open(void);
+pm_InputStream *pm_input_stream_add(uint32_t, unsigned);
+
+static inline pm_InputStream *pm_input_stream(uint32_t key) {
+    unsigned slot = (key * 0x9e3779b1U) >> (32 - PM_INPUT_DR_HASH_BITS);
+
+    while (pm_in.dr[slot].key) {
+        if (pm_in.dr[slot].key == key)
+            return pm_in.dr[slot].s;
+        slot = (slot + 1) & (PM_INPUT_DR_HASH_SIZE - 1);
+    }
+    // 1st read of DR register
+    return pm_input_stream_add(key, slot);
+}
+
+// read n bytes from stream of DR register key
+// MSB to LSB: byte[0], byte[1], ..., byte[n-1]
+// returns 0 on success, -1 at end of stream when pm_eoi is exit
+static inline int pm_input_read(uint32_t key, unsigned n, target_ulong *val) {
+    pm_InputStream *s = pm_input_stream(key);
+    target_ulong v = 0;
+    size_t end;
+    unsigned i;
+
+    for (i = 0; i < n; i ++) {
+        if (unlikely(s->pos >= s->len)) {
+            if (pm_eoi == PM_EOI_EXIT)
+                return -1;
+            if (pm_eoi == PM_EOI_WRAP && s->len)
+                s->pos = 0;
+            else {
+                v <<= 8; // PM_EOI_ZERO
+                continue;
+            }
+        }
+        v = (v << 8) + s->buf[s->pos ++];
+    }
+    // keeps the largest offset, so wrap reports the whole stream
+    end = s->buf + s->pos - pm_in.buf;
+    if (pm_input && end > pm_input->consumed)
+        pm_input->consumed = end;
+    *val = v;
+    return 0;
+}
+
+#endif /* _PM_INPUT_H */
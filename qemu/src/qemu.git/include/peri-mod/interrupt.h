@@ -1,12 +1,13 @@
 #ifndef _INTERRUPT_H
 #define _INTERRUPT_H
 
+#include "peri-mod/options.h" // pm_int_period, pm_int_countdown
+
 typedef struct {
     // exception number under NVIC instead of GIC
     // NVIC: exception no = int no + 16
     // GIC: exception no = int no + 32
     int int_num;
-    int enabled;
 } pm_Int;
 
 
@@ -17,6 +18,8 @@ typedef struct {
 
     pm_Int arr[PM_MAX_INT_EN_NUM];
     int arr_size;
+    // bit i set if arr[i] is enabled
+    uint32_t enabled;
 
     // arr idx dictating next interrupt to fire
     int cur_int;
@@ -33,6 +36,6 @@ void pm_fire_interrupt(void);
 extern volatile int int_round;
 
 // pm_stage FUZZING
-#define FUZZING_INT_FREQ 1000
+#define FUZZING_INT_FREQ 1000 // default of pm_int_period
 
 #endif /* _INTERRUPT_H */
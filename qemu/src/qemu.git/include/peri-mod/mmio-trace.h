@@ -0,0 +1,79 @@
+#ifndef _MMIO_TRACE_H
+#define _MMIO_TRACE_H
+
+#include "peri-mod/peri-mod.h" // cur_bbl_s, cur_bbl_e
+#include "peri-mod/options.h" // pm_trace_open
+
+/*
+ * Binary MMIO trace, replaces the printf on every MMIO access.
+ *
+ * Records are appended to a ring living in a file mmap'ed MAP_SHARED
+ * (-mmio-trace fname), so the trace survives crashes, is shared by forked
+ * workers and can be dumped at any time, even while QEMU is running, by
+ * utilities/mmio_trace/decode.py, which prints the same text as the old printf.
+ *
+ * There is a single writer at a time (the cpu thread of either forkserver or
+ * worker). head is bumped only after a record is filled, so a reader never
+ * sees a half-written record unless the ring wraps around under it.
+ *
+ * Tracing is off unless -mmio-trace is given, which costs a NULL check.
+ */
+#define PM_TRACE_MAGIC 0x52544d50 // "PMTR"
+#define PM_TRACE_VERSION 1
+#define PM_TRACE_REC_NUM (1 << 20) // # of records in ring, power of 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t rec_num;
+    // # of records ever written, next record goes to rec[head % rec_num]
+    uint64_t head;
+} pm_TraceHdr;
+
+// dir
+#define PM_TRACE_R 0
+#define PM_TRACE_W 1
+
+// type for access not served by peripheral model, otherwise pm_reg_type_t
+#define PM_TRACE_UNASSIGNED 0xff
+
+typedef struct {
+    uint32_t bbl_s, bbl_e;
+    uint32_t addr;
+    uint32_t val;
+    uint32_t pm_cnt; // pm(or unassigned)-th access in dir
+    uint32_t cnt; // total-th access in dir
+    uint8_t dir;
+    uint8_t prev_type;
+    uint8_t type;
+    uint8_t size;
+} pm_TraceRec;
+
+extern pm_TraceHdr *pm_trace;
+
+static inline void pm_trace_rec(uint8_t dir, uint32_t addr, uint32_t val,
+        unsigned size, uint8_t prev_type, uint8_t type, uint32_t pm_cnt,
+        uint32_t cnt) {
+    pm_TraceRec *r;
+    uint64_t head;
+
+    if (likely(!pm_trace))
+        return;
+
+    head = pm_trace->head;
+    r = (pm_TraceRec *)(pm_trace + 1) + (head & (pm_trace->rec_num - 1));
+    r->bbl_s = cur_bbl_s;
+    r->bbl_e = cur_bbl_e;
+    r->addr = addr;
+    r->val = val;
+    r->pm_cnt = pm_cnt;
+    r->cnt = cnt;
+    r->dir = dir;
+    r->prev_type = prev_type;
+    r->type = type;
+    r->size = size;
+    __atomic_store_n(&pm_trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* _MMIO_TRACE_H */
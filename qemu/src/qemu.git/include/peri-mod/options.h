@@ -0,0 +1,33 @@
+#ifndef _PM_OPTIONS_H
+#define _PM_OPTIONS_H
+
+/*
+ * Command line options of peri-mod and the AFL fork server, set by vl.c.
+ *
+ * Unlike peri-mod.h, nothing here depends on cpu.h, so vl.c, which is built
+ * once for all targets, can include it. The headers of the modules that own
+ * these symbols include it too.
+ */
+
+// -mmio-trace, see peri-mod/mmio-trace.h
+int pm_trace_open(const char *);
+
+// -pm-eoi, see peri-mod/input.h
+int pm_eoi_parse(const char *);
+
+// -pm-persist, max # of testcases per child, 0 if off, see peri-mod/snapshot.h
+extern unsigned int pm_persist;
+
+// -pm-int-period, # of BBL between 2 interrupts fired. Has to be the same in
+// fuzzing and replay of its testcases in ME
+extern unsigned int pm_int_period;
+// # of BBL before next interrupt is fired, in stage FUZZING and replay
+extern int pm_int_countdown;
+
+// -pm-single-thread, see afl_forkserver_on_cpu_thread() in cpus.c
+extern int pm_single_thread;
+
+// -pm-map-size, live part of the AFL map, see afl/afl-qemu-cpu-inl.h
+extern unsigned int afl_map_size;
+
+#endif /* _PM_OPTIONS_H */
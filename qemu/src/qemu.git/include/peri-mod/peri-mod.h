@@ -32,10 +32,10 @@ target_ulong doneWork(target_ulong);
  */
 
 /*
- * TODO for the sake of performance 
- * I use hardcoded array size/addr range in
- * PM_MAX_EVT_NUM, PM_MAX_REG_NUM, PM_PERI_ADDR_RANGE
- * In the future, size can be loaded from model learned to achieve best perf and space
+ * Register and event arrays are sized from the model loaded, or grown on
+ * demand for registers accessed the first time. Each is split into:
+ * - hot part, touched on every MMIO access/SR read, kept small and dense
+ * - cold part, ME bookkeeping and data needed only on a candidate match
  */
 
 // Data structure for Level 4
@@ -43,25 +43,42 @@ target_ulong doneWork(target_ulong);
 #define PM_MAX_SATISFY_NUM 16
 #define PM_MAX_BIT_COMB_SZ 3 // assume at most 3 SR
 #define PM_SET_BITS 3 // assume set at most 2=3-1 bits: set/clear, bitx, bity
+#define PM_MAX_EVT_NUM 0xfffe // evt_hash holds event idx + 1 in uint16_t
+
+// one "idx:0xval" of CR_val in JSON
+typedef struct {
+    int idx;
+    target_ulong val;
+} pm_CRVal;
+
 // per srr_site
 typedef struct {
-    // srr_site is currently defined by bbl_s
-    char CR_val[PM_MAX_CR_VAL_BYTE];
+    // key, srr_site is currently defined by bbl_s
     target_ulong bbl_e;
-
-    int sr_num;
-    int set_bits;
-    int satisfy[PM_MAX_SATISFY_NUM][PM_MAX_BIT_COMB_SZ][PM_SET_BITS];
-    int satisfy_num;
-
+    uint32_t cr_key; // pm_cr_hash of all pairs of CR_val xor'ed together
+    uint16_t cr_num;
     // for CR_SR read handled in SR way
-    int r_idx;
+    uint8_t r_idx;
+
+    uint8_t sr_num;
+    uint8_t set_bits;
+    uint8_t satisfy_num;
 
     // for evt_sched's internal usage
-    int cur_satisfy; // needed only by round robin evt_sched
-    int cur_sr;
+    uint8_t cur_satisfy; // needed only by round robin evt_sched
+    uint8_t cur_sr;
+
+    // CR_val is parsed from its JSON string at load time, cr_num pairs
+    pm_CRVal *CR_val;
+    // satisfy[satisfy_num][sr_num][set_bits+1], see pm_evt_satisfy
+    uint8_t *satisfy;
 } pm_Event;
 
+// satisfy[k][l][0] is set/clear of SR l in bit combination k, followed by bits
+static inline uint8_t *pm_evt_satisfy(pm_Event *e, int k, int l) {
+    return e->satisfy + (k * e->sr_num + l) * (e->set_bits + 1);
+}
+
 
 // Data structure for Level 3
 typedef enum {
@@ -80,65 +97,198 @@ typedef enum {
     REG_W,
 } pm_reg_pa_t;
 
+// hot, 16 bytes
 typedef struct {
-    pm_reg_type_t type;
+    uint8_t type; // pm_reg_type_t
+    // category of CR_SR/SR is locked
+    uint8_t sr_locked;
     //target_ulong val;
     unsigned char val_b[4]; // at most 4 bytes, byte 0, 1, 2, 3
-
-    // record value of cr when SR_r happens
-    // TODO support multi-SR
-    target_ulong cr_val;
-
-    // category of CR_SR/SR is locked
-    int sr_locked;
+    // DR only: widest access observed, # of input bytes consumed per read
+    uint8_t dr_bytes;
 
     // used by CR/CR_SR/maybe SR in the future
     // there may be multiple read on CR_SR in same bbl, some handled in CR way. 
     // at most ONE in SR way (its 0-started read idx is recorded here)
     int r_idx_in_bbl;
     int last_r_bbl_cnt;
+} pm_MMIORegister;
+
+// cold, only used in ME
+typedef struct {
+    // record value of cr when SR_r happens
+    // TODO support multi-SR
+    target_ulong cr_val;
 
     // has ever/never(0/1) been read/write
     int read;
     int write;
-} pm_MMIORegister;
+} pm_MMIORegCold;
 
 
 // Data structure for Level 2
 // TODO 1kb or 4kb, which is better?
-#define PM_PERI_ADDR_RANGE (1 << 9)
-#define PM_MAX_REG_NUM (PM_PERI_ADDR_RANGE >> 2)
-#define PM_MAX_EVT_NUM 64
+#define PM_PERI_ADDR_BITS 9
+#define PM_PERI_ADDR_RANGE (1 << PM_PERI_ADDR_BITS)
+#define PM_MAX_REG_NUM PM_PERI_ADDR_RANGE // 1-byte regs
+#define PM_INIT_REG_NUM 16 // regs allocated by create_peri
 
 // 0'ed in create_peri
 typedef struct pm_Peripheral{
     target_ulong base_addr;
+    unsigned reg_size; // bytes in each reg
 
-    // regs
-    pm_MMIORegister regs[PM_MAX_REG_NUM];
+    // regs, regs_cold[i] is cold part of regs[i]
+    pm_MMIORegister *regs;
+    pm_MMIORegCold *regs_cold;
     int max_reg_idx;
-    int DR_bytes_num; // num of bytes used in DR, to avoid wasting AFL input
-    unsigned reg_size; // bytes in each reg
+    int reg_cap; // # of regs allocated
+
+    // cr_key/cr_num of current CR/CR_SR values, maintained on CR write and
+    // reg_cat, so that pm_SR_find_model needn't scan regs
+    uint32_t cr_key;
+    int cr_num;
 
     // events
     // for each event, key = (CR_val, bbl_e), val = (bit combinations)
-    pm_Event events[PM_MAX_EVT_NUM];
+    pm_Event *events;
     unsigned int evt_num; // i.e. srr_site num
+    // open addressing index on (cr_key, bbl_e), holds event idx + 1
+    uint16_t *evt_hash;
+    unsigned int evt_hash_mask; // size - 1, size is power of 2
+
+    // MR dispatching accesses of [base_addr, base_addr + PM_PERI_ADDR_RANGE)
+    MemoryRegion *mr;
 
     struct pm_Peripheral *next; 
 } pm_Peripheral;
 
+void pm_peri_grow_regs(pm_Peripheral *, int);
+
+// regs[idx], grows regs if needed
+static inline pm_MMIORegister *pm_peri_reg(pm_Peripheral *peri, int idx) {
+    if (unlikely(idx >= peri->reg_cap))
+        pm_peri_grow_regs(peri, idx);
+    if (idx > peri->max_reg_idx) peri->max_reg_idx = idx;
+    return &peri->regs[idx];
+}
+
+
+// Operations for Level 2 & 3
+static inline int pm_is_cr(pm_reg_type_t type) {
+    return type == CR || type == CR_SR;
+}
+
+static inline target_ulong pm_reg_val(pm_MMIORegister *reg) {
+    return reg->val_b[0] | reg->val_b[1] << 8 | reg->val_b[2] << 16 |
+        (target_ulong)reg->val_b[3] << 24;
+}
+
+// CR_val is a set of (idx, val), so its key is the xor of hashes of each pair
+static inline uint32_t pm_cr_hash(int idx, target_ulong val) {
+    uint32_t h = val + (uint32_t)idx * 0x9e3779b9U;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+// val of CR/CR_SR regs[idx] changes from old_val to new_val
+static inline void pm_cr_key_update(pm_Peripheral *peri, int idx,
+        target_ulong old_val, target_ulong new_val) {
+    peri->cr_key ^= pm_cr_hash(idx, old_val) ^ pm_cr_hash(idx, new_val);
+}
+
+// type of regs[idx] changes from prev_type
+void pm_cr_key_retype(pm_Peripheral *, int, pm_reg_type_t);
+void pm_cr_key_rebuild(pm_Peripheral *);
+void pm_evt_index_build(pm_Peripheral *);
+
 
 // Data structure & operations for Level 1
 extern pm_Peripheral * volatile pm_PeripheralList;
 pm_Peripheral *create_peri(target_ulong);
-pm_Peripheral *get_peri(target_ulong);
+
+/*
+ * pm_PeripheralList is walked only by dump/reload. MMIO accesses look up
+ * peripherals through a two-level table indexed by
+ * (addr - PM_PERI_REGION_BASE) >> PM_PERI_ADDR_BITS, so the cost of get_peri
+ * does not depend on the number of peripherals. L2 pages are allocated on
+ * demand, so only address windows that are really used take memory.
+ */
+#define PM_PERI_REGION_BASE 0x40000000U
+#define PM_PERI_REGION_BITS 29 // 0x40000000 - 0x60000000
+#define PM_PERI_IDX_BITS (PM_PERI_REGION_BITS - PM_PERI_ADDR_BITS)
+#define PM_PERI_L2_BITS 10
+#define PM_PERI_L1_BITS (PM_PERI_IDX_BITS - PM_PERI_L2_BITS)
+#define PM_PERI_L1_SIZE (1 << PM_PERI_L1_BITS)
+#define PM_PERI_L2_SIZE (1 << PM_PERI_L2_BITS)
+
+extern pm_Peripheral **pm_peri_table[PM_PERI_L1_SIZE];
+void pm_peri_table_insert(pm_Peripheral *);
+void pm_peri_table_reset(void);
+
+/*
+ * Each peripheral is mapped into system memory with its own MemoryRegion,
+ * so softmmu dispatches accesses straight to pm_mmio_read/write instead of
+ * going through the unassigned memory fallback. The fallback only catches
+ * the first access to a peripheral that is not modeled yet.
+ */
+void pm_peri_map(pm_Peripheral *);
+void pm_peri_unmap(pm_Peripheral *);
+uint64_t pm_mmio_read(pm_Peripheral *, target_ulong, unsigned);
+void pm_mmio_write(pm_Peripheral *, target_ulong, uint64_t, unsigned);
+
+static inline pm_Peripheral *get_peri(target_ulong reg_addr) {
+    target_ulong idx = reg_addr - PM_PERI_REGION_BASE;
+    pm_Peripheral **l2;
+
+    if (idx >> PM_PERI_REGION_BITS)
+        return NULL; // out of peripheral region
+    idx >>= PM_PERI_ADDR_BITS;
+    l2 = pm_peri_table[idx >> PM_PERI_L2_BITS];
+    return l2 ? l2[idx & (PM_PERI_L2_SIZE - 1)] : NULL;
+}
 
 
 // dump/load 
 int pm_dump_model(pm_Peripheral *);
 int pm_load_model(pm_Peripheral **);
-pm_Peripheral *pm_reload_model(void);
+pm_Peripheral *pm_reload_model(const char *path);
+
+// binary model, cache of JSON model, see peri-mod.c
+#define PM_MODEL_BIN_MAGIC 0x424d4d50 // "PMMB"
+#define PM_MODEL_BIN_VERSION 3
+// sections besides model
+#define PM_MODEL_BIN_SR_READ 0x1 // sr_read in SR_R_EXPLORE
+#define PM_MODEL_BIN_AUP 0x2 // access_to_unmodeled_peri
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hdr_size;
+    uint32_t flags;
+    // layout of the image
+    uint32_t peri_size; // sizeof(pm_Peripheral)
+    uint32_t evt_size;
+    uint32_t reg_size;
+    uint32_t reg_cold_size;
+    // JSON model the binary is converted from
+    uint64_t json_size;
+    int64_t json_mtime_ns;
+    uint32_t peri_num;
+    // sr_read
+    uint32_t srr_site;
+    int32_t CR_SR_r_idx;
+    uint32_t target_bbl_cnt;
+    uint32_t sr_func_ret_num;
+    // access_to_unmodeled_peri
+    uint32_t replay_bbl_cnt;
+} pm_ModelBinHdr;
+// followed by pm_Peripheral[peri_num], uint32_t sr_func_ret_addr[sr_func_ret_num]
+// and 8-byte aligned regs, regs_cold, events, CR_val and satisfy arrays
 
 // handles SR read, the most trick register
 // TODO may only need first two args
@@ -163,6 +313,16 @@ extern const char *model_of;
 // for stage 1, the number is dumped into JSON and includes bbl where SR_r happens
 extern volatile unsigned int bbl_cnt; // # of BBL that has finsihed exec
 extern uint32_t cur_bbl_s, cur_bbl_e;
+// maintained by TBs themselves when pm_tb_inline(), see gen_aflBBlock
+extern uint32_t pm_bbl_started; // # of BBL that has started exec
+extern int pm_tb_running; // TB is being executed, set by cpu_exec
+// PC in flash or SRAM of the MCU
+int pm_code_addr_ok(uint32_t);
+// exec at PC ends the run with "illegal exec", 0xFFFFFFF0 and up are
+// exception return magic. Checked by tb_gen_code, see TranslationBlock
+static inline int pm_exec_addr_illegal(uint32_t pc) {
+    return !pm_code_addr_ok(pc) && pc < 0xFFFFFFF0U;
+}
 
 // SR_R_ID stage
 // terminate when observe real SR_r
@@ -183,6 +343,12 @@ extern uint32_t *sr_func_ret_addr;
 int is_sr_func_ret_addr(uint32_t);
 extern FILE *trace_f;
 extern FILE *reg_acc_f;
+
+// stage FUZZING w/o trace: per-BBL work of cpu_tb_exec is emitted into TBs,
+// which allows TB chaining
+static inline int pm_tb_inline(void) {
+    return pm_stage == FUZZING && !trace_f;
+}
 extern volatile int expl_started;
 #define SR_R_THRESH_HOLD 4 // usart isr has at most 4 unpexted sr_r
 extern uint32_t srr_site;
@@ -201,10 +367,47 @@ extern int CR_SR_r_idx_in_bbl; // 1-started index, 0 if not used
 extern const char *aflFile;
 #define PM_UNCAT_REG 0x40
 #define PM_UNMOD_SRRS 0x41
-#define PM_ME_EXIT 0x50
 extern const char *me_bin;
 extern const char *me_config;
-extern int run_num;
 extern int aup_reason;
 extern int afl_startfs_invoked;
+// testcase from afl-fuzz through shm, keep in sync with afl/peri-mod.h
+#define PM_INPUT_SHM_ENV_VAR "__PM_INPUT_SHM_ID"
+#define PM_INPUT_MAX_LEN (1 * 1024 * 1024)
+// multi-stream testcase, see peri-mod/input.h
+#define PM_INPUT_STREAM_MAGIC "PMIS"
+#define PM_INPUT_MAX_STREAMS 64
+// sparse coverage, map slots going from 0 to 1, see afl_edge_new()
+#define PM_EDGE_LIST_MAX 8192
+struct pm_input_shm {
+    unsigned int used; // set by QEMU when it reads testcase from here
+    unsigned int len;
+    unsigned int consumed; // end offset of bytes read by DR, set by QEMU
+    unsigned int key_num; // DR registers read, set by QEMU
+    unsigned int keys[PM_INPUT_MAX_STREAMS];
+    unsigned int tsl_num; // blocks translated by last exec, set by forkserver
+    unsigned int restore_pages; // RAM pages restored after last exec, and
+    unsigned int restore_ns; // time taken, set by QEMU with -pm-persist
+    unsigned int fork_ns; // from fork server getting a request to the child
+                          // running it, set by forkserver
+    unsigned int edge_log; // set by afl-fuzz to have edges filled
+    unsigned int edge_num; // may exceed PM_EDGE_LIST_MAX, reset by afl-fuzz
+    unsigned int edges[PM_EDGE_LIST_MAX];
+    unsigned char buf[PM_INPUT_MAX_LEN];
+};
+// NULL unless QEMU is run by afl-fuzz in FUZZING, then aflFile is a fallback
+extern struct pm_input_shm *pm_input;
+// models published by afl-fuzz, keep in sync with afl/peri-mod.h
+#define PM_MODEL_REG_ENV_VAR "__PM_MODEL_REG"
+#define PM_MODEL_PATH_MAX 256
+struct pm_model_registry {
+    unsigned int generation; // bumped by 2 per model, odd while path changes
+    unsigned int next_run; // ME round to hand out next
+    int me_owner; // afl-fuzz running ME, 0 if none
+    char path[PM_MODEL_PATH_MAX]; // absolute path of the published model
+};
+// NULL unless the fork server is run by afl-fuzz, read only
+extern struct pm_model_registry *pm_model_reg;
+// in FUZZING, model dumped on access to unmodeled peripheral, for ME
+#define PM_AUP_MODEL_SUFFIX ".aup.json"
 #endif /* _PERI_MOD_H */
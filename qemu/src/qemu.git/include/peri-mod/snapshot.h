@@ -0,0 +1,33 @@
+#ifndef _PM_SNAPSHOT_H
+#define _PM_SNAPSHOT_H
+
+#include "peri-mod/peri-mod.h"
+#include "peri-mod/options.h"
+
+/*
+ * Persistent fuzzing (-pm-persist n, see pm_persist), stage FUZZING only.
+ *
+ * Instead of forking a child per testcase, the fork server child runs up to
+ * n testcases. Right after it is forked, i.e. in the state startForkserver
+ * leaves the firmware in, the child takes a snapshot of
+ * - CPU registers, NVIC (incl. SysTick) and pm_interrupt
+ * - guest SRAM
+ * - register values and event states of pm_Peripheral
+ * - BBL counters, fuzzer input and AFL edge state
+ * A testcase terminated by doneWork without error rolls them back, then the
+ * child stops itself, and the fork server resumes it with the next testcase
+ * instead of forking. Everything else (crash, timeout, non-zero doneWork,
+ * ME) ends the child as before, the next testcase gets a new one.
+ *
+ * SRAM is dirty-logged (DIRTY_MEMORY_VGA), so only pages written by the
+ * testcase are copied back. # of them and the time taken by the restore are
+ * reported to afl-fuzz in pm_input.
+ *
+ * Device models other than NVIC, and timers driven by virtual clock when
+ * aflEnableTicks is set, are not rolled back.
+ */
+void pm_snapshot_take(CPUState *);
+// returns only if the child should exit instead
+void pm_snapshot_next(void);
+
+#endif /* _PM_SNAPSHOT_H */
@@ -29,6 +29,8 @@
 #if defined(CONFIG_GNU_ARM_ECLIPSE)
 #include "qemu/log.h"
 #include "peri-mod/peri-mod.h"
+#include "peri-mod/mmio-trace.h"
+#include "peri-mod/input.h"
 #include <sys/mman.h>
 #endif
 
@@ -1159,43 +1161,22 @@ volatile int SR_cat_by_fixup = 0;
 int handle_hybrid_SR_way = 0;
 int CR_SR_r_idx_in_bbl = 0;
 
-static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
-                                    unsigned size)
-{
-    static int cnt = 0, pm_cnt = 0;
-//#ifdef DEBUG_UNASSIGNED
-//    printf("Unassigned mem read " TARGET_FMT_plx "\n", addr);
-//#endif
-    if (current_cpu != NULL) {
-        cpu_unassigned_access(current_cpu, addr, false, false, 0, size);
-    }
+// # of (all/peripheral) accesses, shared by unassigned and peripheral MR path
+static int mem_r_cnt = 0, pm_r_cnt = 0;
+static int mem_w_cnt = 0, pm_w_cnt = 0;
 
 /*
- * We always enable pm, i.e. pm_ena is always 1
- *
- * Same to syscall no/param, we don't care whether AFL is attached or not, 
- * as long as we have the input file generated by AFL
+ * Serve a read on a modeled peripheral. Called from the peripheral's own
+ * MemoryRegion (see pm_peri_map), or from unassigned_mem_read for the first
+ * access to a peripheral that is not in the model yet.
  */
-
-    cnt ++;
-    if(pm_ena && (addr >= 0x40000000 && addr < 0x60000000)) {
-        // TODO peripheral region. Need to include internal peri
-
-        pm_cnt ++;
-        // in cpu-defs.h typedef uint32_t target_ulong;
-        target_ulong addr32 = (target_ulong)addr;
-
-        pm_Peripheral *peri = get_peri(addr32);
-        if (!peri) {
-            peri = create_peri(addr32);
-            // assume all reg of a peri have the same size
-            peri->reg_size = size;
-        }
+uint64_t pm_mmio_read(pm_Peripheral *peri, target_ulong addr32, unsigned size)
+{
+        int cnt = ++mem_r_cnt, pm_cnt = ++pm_r_cnt;
 
         unsigned int reg_idx = (addr32 % PM_PERI_ADDR_RANGE) / peri->reg_size;
         unsigned int reg_byte_offset = (addr32 % PM_PERI_ADDR_RANGE) % peri->reg_size;
-        if (reg_idx > peri->max_reg_idx) peri->max_reg_idx = reg_idx;
-        pm_MMIORegister *reg = &peri->regs[reg_idx];
+        pm_MMIORegister *reg = pm_peri_reg(peri, reg_idx);
        
         // by default returns 0
         target_ulong ret_val = 0;
@@ -1204,7 +1185,7 @@ static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
 
         if (pm_me_ena) {
             // reg_cat
-            reg->read = 1;
+            peri->regs_cold[reg_idx].read = 1;
 
             if (reg->type == UC) {
                 if (!(pm_stage == SR_R_EXPLORE && expl_started)) {
@@ -1256,6 +1237,8 @@ static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
             pa = REG_R;
             preg_type = reg->type;
             pbbl_e = cur_bbl_e;
+
+            pm_cr_key_retype(peri, reg_idx, prev_type);
         }
 
         int i, i_b;
@@ -1321,9 +1304,9 @@ static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
                       stage_term_peri_ba = peri->base_addr;
 
                       for (i = 0; i <= peri->max_reg_idx; i ++)
-                        //peri->regs[i].cr_val = peri->regs[i].val;
+                        //peri->regs_cold[i].cr_val = peri->regs[i].val;
                         for (i_b = 0; i_b < 4; i_b ++) {
-                          peri->regs[i].cr_val |= peri->regs[i].val_b[i_b] << (i_b * 8);
+                          peri->regs_cold[i].cr_val |= peri->regs[i].val_b[i_b] << (i_b * 8);
                         }
 
                       if (reg->type == CR_SR) {
@@ -1446,6 +1429,11 @@ static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
                 break;
 
             case DR:
+              // width follows the widest access, e.g. 1 byte for UART LDRB, so
+              // that input bytes map 1:1 onto what firmware reads
+              if (size > reg->dr_bytes)
+                reg->dr_bytes = MIN(size, sizeof(target_ulong));
+
               switch(pm_stage) {
               case SR_R_ID:
               case SR_R_EXPLORE:
@@ -1465,49 +1453,22 @@ static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
                 ret_val = 0;
               } else {
                 // in worker process
-                // ret_val: MSB to LSB: byte[0], byte[1], ..., byte[DR_bytes_num]
-                if (!pm_rand_sz) {
-                    int fd = open(aflFile, O_RDONLY);
-                    if (fd == -1) {
-                        perror("open");
-                        doneWork_p = 0x70;
-                    }
-
-                    struct stat sb;
-                    if (stat(aflFile, &sb) == -1) {
-                        perror("stat");
+                // ret_val: MSB to LSB: byte[0], byte[1], ..., byte[dr_bytes - 1]
+                if (!pm_in.buf) {
+                    if (pm_input_open()) {
                         doneWork_p = 0x70;
-                    }
-
-                    if (sb.st_size < PM_RAND_MIN_SIZE) {
-                        // no enough bytes in aflFile
+                    } else if (pm_in.len < PM_RAND_MIN_SIZE) {
+                        // no enough bytes in testcase
                         fprintf(stderr, "No enough bytes for PM_RAND, MIN: %d\n", PM_RAND_MIN_SIZE);
                         doneWork_p = 0x70;
                     }
-
-                    // copy input into pm_rand
-                    // no more than PM_RAND_ARR_SIZE bytes, to avoid buffer overflow
-                    pm_rand_sz = (sb.st_size > PM_RAND_ARR_SIZE) ? PM_RAND_ARR_SIZE : sb.st_size;
-                    if (read(fd, pm_rand, pm_rand_sz) < pm_rand_sz) {
-                        perror("read");
-                        doneWork_p = 0x70;
-                    }
-
-                    if (close(fd) == -1) {
-                        perror("close");
-                        doneWork_p = 0x70;
-                    }
                 }
 
-                for (i = 0; i < peri->DR_bytes_num; i ++) {
-                    ret_val = (ret_val << 8) + (target_ulong)pm_rand[pm_rand_i];
-                    //pm_rand_i = (pm_rand_i+1)%pm_rand_sz;
-                    // remove circular buffer. calls donwWork(0xab) when drains input
-                    pm_rand_i ++;
-                    if (pm_rand_i > pm_rand_sz) {
-                        snprintf(err_msg, 80, "[Error] Run out of input bytes!\n");
-                        doneWork_p = 0x71;
-                    }
+                // calls donwWork(0x71) when drains input, unless -pm-eoi says otherwise
+                if (!doneWork_p && pm_input_read(addr32 - reg_byte_offset,
+                        reg->dr_bytes, &ret_val)) {
+                    snprintf(err_msg, 80, "[Error] Run out of input bytes!\n");
+                    doneWork_p = 0x71;
                 }
               } // end of if (!aflStart)
               } // end of switch (pm_stage)
@@ -1526,12 +1487,8 @@ static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
                 addr32, reg->type, ret_val, cur_bbl_s, cur_bbl_e,
                 lookup_symbol(cur_bbl_s));
 
-        if (prev_type == reg->type)
-            printf("[%x, %x] %3d-th(total %3d-th) \tpm_r *0x%x gets 0x%x, remains %s\n",
-                cur_bbl_s, cur_bbl_e, pm_cnt, cnt, addr32, ret_val, pm_rt_str(reg->type));
-        else
-            printf("[%x, %x] %3d-th(total %3d-th) \tpm_r *0x%x gets 0x%x, turns %s into %s\n",
-                cur_bbl_s, cur_bbl_e, pm_cnt, cnt, addr32, ret_val, pm_rt_str(prev_type), pm_rt_str(reg->type));
+        pm_trace_rec(PM_TRACE_R, addr32, ret_val, size, prev_type, reg->type,
+            pm_cnt, cnt);
 
 
         if (doneWork_p) {
@@ -1540,42 +1497,58 @@ static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
         }
 
         return (uint64_t)ret_val;
-    } else {
-        printf("[%x, %x] %3d-th(total %3d-th) \tunassigned mem_r *0x%x\n", 
-            cur_bbl_s, cur_bbl_e, cnt-pm_cnt, cnt, addr);
-    }
-    return 0;
 }
 
-static void unassigned_mem_write(void *opaque, hwaddr addr,
-                                 uint64_t val, unsigned size)
+static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
+                                    unsigned size)
 {
-    static int cnt = 0, pm_cnt = 0;
 //#ifdef DEBUG_UNASSIGNED
-//    printf("Unassigned mem write " TARGET_FMT_plx " = 0x%"PRIx64"\n", addr, val);
+//    printf("Unassigned mem read " TARGET_FMT_plx "\n", addr);
 //#endif
     if (current_cpu != NULL) {
-        cpu_unassigned_access(current_cpu, addr, true, false, 0, size);
+        cpu_unassigned_access(current_cpu, addr, false, false, 0, size);
     }
 
-    cnt ++;
-    if (pm_ena && (addr >= 0x40000000 && addr < 0x60000000)) {
+/*
+ * We always enable pm, i.e. pm_ena is always 1
+ *
+ * Same to syscall no/param, we don't care whether AFL is attached or not, 
+ * as long as we have the input file generated by AFL
+ */
+
+    if(pm_ena && (addr >= 0x40000000 && addr < 0x60000000)) {
         // TODO peripheral region. Need to include internal peri
 
-        pm_cnt ++;
+        // in cpu-defs.h typedef uint32_t target_ulong;
         target_ulong addr32 = (target_ulong)addr;
 
+        // peripheral is not modeled yet, later accesses go to its MR
         pm_Peripheral *peri = get_peri(addr32);
         if (!peri) {
             peri = create_peri(addr32);
             // assume all reg of a peri have the same size
             peri->reg_size = size;
         }
+        return pm_mmio_read(peri, addr32, size);
+    }
+
+    mem_r_cnt ++;
+    pm_trace_rec(PM_TRACE_R, addr, 0, size, PM_TRACE_UNASSIGNED,
+        PM_TRACE_UNASSIGNED, mem_r_cnt-pm_r_cnt, mem_r_cnt);
+    return 0;
+}
+
+/*
+ * Serve a write on a modeled peripheral, counterpart of pm_mmio_read
+ */
+void pm_mmio_write(pm_Peripheral *peri, target_ulong addr32, uint64_t val,
+                   unsigned size)
+{
+        int cnt = ++mem_w_cnt, pm_cnt = ++pm_w_cnt;
 
         unsigned int reg_idx = (addr32 % PM_PERI_ADDR_RANGE) / peri->reg_size;
         unsigned int reg_byte_offset = (addr32 % PM_PERI_ADDR_RANGE) % peri->reg_size;
-        if (reg_idx > peri->max_reg_idx) peri->max_reg_idx = reg_idx;
-        pm_MMIORegister *reg = &peri->regs[reg_idx];
+        pm_MMIORegister *reg = pm_peri_reg(peri, reg_idx);
        
         // by default write val
         target_ulong wri_val = (target_ulong)val;
@@ -1584,7 +1557,7 @@ static void unassigned_mem_write(void *opaque, hwaddr addr,
 
         if (pm_me_ena) {
             // reg_cat
-            reg->write = 1;
+            peri->regs_cold[reg_idx].write = 1;
 
             if (reg->type == UC) {
                 reg->type = DR;
@@ -1606,6 +1579,8 @@ static void unassigned_mem_write(void *opaque, hwaddr addr,
             preg_type = reg->type;
             pbbl_e = cur_bbl_e;
 
+            pm_cr_key_retype(peri, reg_idx, prev_type);
+
 
             if (pm_stage == SR_R_ID || pm_stage == SR_R_EXPLORE && expl_started) {
                 // in pi
@@ -1615,14 +1590,11 @@ static void unassigned_mem_write(void *opaque, hwaddr addr,
             }
         }
 
-        if (prev_type == reg->type)
-            printf("[%x, %x] %3d-th(total %3d-th) \tpm_w *0x%x = 0x%x, remains %s\n",
-                cur_bbl_s, cur_bbl_e, pm_cnt, cnt, addr32, wri_val, pm_rt_str(reg->type));
-        else
-            printf("[%x, %x] %3d-th(total %3d-th) \tpm_w *0x%x = 0x%x, turns %s into %s\n",
-                cur_bbl_s, cur_bbl_e, pm_cnt, cnt, addr32, wri_val, pm_rt_str(prev_type), pm_rt_str(reg->type));
+        pm_trace_rec(PM_TRACE_W, addr32, wri_val, size, prev_type, reg->type,
+            pm_cnt, cnt);
 
         int i_b;
+        target_ulong old_val;
         switch (reg->type) {
             case UC:
                 fprintf(stderr, "Uncategorized register 0x%x is accessed!\n", addr32);
@@ -1634,9 +1606,11 @@ static void unassigned_mem_write(void *opaque, hwaddr addr,
             case CR_SR:
             case CR:
                 //reg->val = wri_val;
+                old_val = pm_reg_val(reg);
                 for (i_b = 0; i_b < size; i_b ++) {
                   reg->val_b[reg_byte_offset + i_b] = (unsigned char)(wri_val >> (i_b * 8));
                 }
+                pm_cr_key_update(peri, reg_idx, old_val, pm_reg_val(reg));
                 break;
 
             case SR:
@@ -1652,10 +1626,37 @@ static void unassigned_mem_write(void *opaque, hwaddr addr,
                 fprintf(stderr, "[Error] Register type %d is not supported!\n", reg->type);
                 doneWork(0x75);
         }
-    } else {
-        printf("[%x, %x] %3d-th(total %3d-th) \tunassigned mem_w *0x%x = 0x%x\n",
-            cur_bbl_s, cur_bbl_e, cnt-pm_cnt, cnt, addr, val);
+}
+
+static void unassigned_mem_write(void *opaque, hwaddr addr,
+                                 uint64_t val, unsigned size)
+{
+//#ifdef DEBUG_UNASSIGNED
+//    printf("Unassigned mem write " TARGET_FMT_plx " = 0x%"PRIx64"\n", addr, val);
+//#endif
+    if (current_cpu != NULL) {
+        cpu_unassigned_access(current_cpu, addr, true, false, 0, size);
+    }
+
+    if (pm_ena && (addr >= 0x40000000 && addr < 0x60000000)) {
+        // TODO peripheral region. Need to include internal peri
+
+        target_ulong addr32 = (target_ulong)addr;
+
+        // peripheral is not modeled yet, later accesses go to its MR
+        pm_Peripheral *peri = get_peri(addr32);
+        if (!peri) {
+            peri = create_peri(addr32);
+            // assume all reg of a peri have the same size
+            peri->reg_size = size;
+        }
+        pm_mmio_write(peri, addr32, val, size);
+        return;
     }
+
+    mem_w_cnt ++;
+    pm_trace_rec(PM_TRACE_W, addr, val, size, PM_TRACE_UNASSIGNED,
+        PM_TRACE_UNASSIGNED, mem_w_cnt-pm_w_cnt, mem_w_cnt);
 }
 
 static bool unassigned_mem_accepts(void *opaque, hwaddr addr,
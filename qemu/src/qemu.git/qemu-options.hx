@@ -2710,6 +2710,24 @@ DEF("trace", HAS_ARG, QEMU_OPTION_trace_f, \
 DEF("reg-acc", HAS_ARG, QEMU_OPTION_reg_acc_f, \
     "-reg-acc fname \tregister access trace is dumped into fname, not used in FUZZING stage\n", QEMU_ARCH_ALL)
 
+DEF("mmio-trace", HAS_ARG, QEMU_OPTION_mmio_trace, \
+    "-mmio-trace fname \tbinary trace of every MMIO access is recorded in a ring mapped from fname\n", QEMU_ARCH_ALL)
+
+DEF("pm-eoi", HAS_ARG, QEMU_OPTION_pm_eoi, \
+    "-pm-eoi exit|zero|wrap \twhat DR reads get after input is drained: terminate the run (default), 0, or input from its start\n", QEMU_ARCH_ALL)
+
+DEF("pm-persist", HAS_ARG, QEMU_OPTION_pm_persist, \
+    "-pm-persist n \teach forked fuzzer run executes up to n testcases, restoring snapshot taken at startForkserver in between, only used in FUZZING stage\n", QEMU_ARCH_ALL)
+
+DEF("pm-single-thread", 0, QEMU_OPTION_pm_single_thread, \
+    "-pm-single-thread \trun forkserver and forked fuzzer runs on the cpu thread, without iothread, only used in FUZZING stage\n", QEMU_ARCH_ALL)
+
+DEF("pm-map-size", HAS_ARG, QEMU_OPTION_pm_map_size, \
+    "-pm-map-size n \tuse n bytes (rounded up to a power of 2 in [64K, 2M]) of AFL coverage map, default is 1/8 of MCU flash size\n", QEMU_ARCH_ALL)
+
+DEF("pm-int-period", HAS_ARG, QEMU_OPTION_pm_int_period, \
+    "-pm-int-period n \tfire an interrupt every n BBL (default 1000) in FUZZING stage and its replay in ME\n", QEMU_ARCH_ALL)
+
 DEF("me-bin", HAS_ARG, QEMU_OPTION_me_bin, \
     "-me-bin fname \tpath to model extraction binary, only used in FUZZING stage\n", QEMU_ARCH_ALL)
 
@@ -2,6 +2,9 @@ DEF_HELPER_0(aflInterceptPanic, void)
 DEF_HELPER_1(aflInterceptLog, void, env)
 DEF_HELPER_4(aflCall32, i32, env, i32, i32, i32)
 DEF_HELPER_4(aflCall, tl, env, tl, tl, tl)
+DEF_HELPER_0(pm_bbl_int, void)
+DEF_HELPER_1(pm_illegal_exec, void, ptr)
+DEF_HELPER_FLAGS_1(afl_edge_new, TCG_CALL_NO_RWG, void, i32)
 
 DEF_HELPER_FLAGS_1(clz, TCG_CALL_NO_RWG_SE, i32, i32)
 DEF_HELPER_FLAGS_1(sxtb16, TCG_CALL_NO_RWG_SE, i32, i32)
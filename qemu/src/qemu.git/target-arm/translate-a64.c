@@ -90,7 +90,8 @@ typedef void NeonGenOneOpFn(TCGv_i64, TCGv_i64);
 typedef void CryptoTwoOpEnvFn(TCGv_ptr, TCGv_i32, TCGv_i32);
 typedef void CryptoThreeOpEnvFn(TCGv_ptr, TCGv_i32, TCGv_i32, TCGv_i32);
 
-void gen_aflBBlock(target_ulong pc);
+void gen_aflBBlock(TranslationBlock *tb);
+void gen_aflBBlockEnd(target_ulong pc_end);
 
 /* initialize TCG globals.  */
 void a64_translate_init(void)
@@ -10952,7 +10953,6 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
     dc->tb = tb;
 
     dc->is_jmp = DISAS_NEXT;
-    gen_aflBBlock(pc_start);
     dc->pc = pc_start;
     dc->singlestep_enabled = cs->singlestep_enabled;
     dc->condjmp = 0;
@@ -11005,6 +11005,7 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
     }
 
     gen_tb_start(tb);
+    gen_aflBBlock(tb);
 
     tcg_clear_temp_count();
 
@@ -11136,6 +11137,7 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
     }
 
 done_generating:
+    gen_aflBBlockEnd(dc->pc);
     gen_tb_end(tb, num_insns);
 
 #ifdef DEBUG_DISAS
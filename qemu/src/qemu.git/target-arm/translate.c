@@ -39,6 +39,8 @@
 
 #if defined(CONFIG_GNU_ARM_ECLIPSE)
 #include "peri-mod/peri-mod.h"
+#include "peri-mod/interrupt.h"
+#include "peri-mod/snapshot.h"
 #include <sys/mman.h>
 #endif
 
@@ -86,7 +88,8 @@ static const char *regnames[] =
     { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
       "r8", "r9", "r10", "r11", "r12", "r13", "r14", "pc" };
 
-void gen_aflBBlock(target_ulong pc);
+void gen_aflBBlock(TranslationBlock *tb);
+void gen_aflBBlockEnd(target_ulong pc_end);
 
 /* initialize TCG globals.  */
 void arm_translate_init(void)
@@ -11193,7 +11196,6 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     dc->tb = tb;
 
     dc->is_jmp = DISAS_NEXT;
-    gen_aflBBlock(pc_start);
     dc->pc = pc_start;
     dc->singlestep_enabled = cs->singlestep_enabled;
     dc->condjmp = 0;
@@ -11254,6 +11256,7 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
         max_insns = CF_COUNT_MASK;
 
     gen_tb_start(tb);
+    gen_aflBBlock(tb);
 
     tcg_clear_temp_count();
 
@@ -11510,6 +11513,7 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     }
 
 done_generating:
+    gen_aflBBlockEnd(dc->pc);
     gen_tb_end(tb, num_insns);
 
 #ifdef DEBUG_DISAS
@@ -11636,11 +11640,14 @@ static target_ulong startForkserver(CPUArchState *env, target_ulong enableTicks)
      * we're running in a cpu thread. we'll exit the cpu thread
      * and notify the iothread.  The iothread will run the forkserver
      * and in the child will restart the cpu thread which will continue
-     * execution.
+     * execution. With -pm-single-thread, the cpu thread runs the
+     * forkserver itself instead.
      * N.B. We assume a single cpu here!
      */
     aflEnableTicks = enableTicks;
     afl_wants_cpu_to_stop = 1;
+    // TBs are chained in stage FUZZING, leave them at next TB
+    cpu_exit(CPU(arm_env_get_cpu(env)));
 
     // merge startWork into startForkserver
     afl_start_code = 0x0U;
@@ -11766,45 +11773,6 @@ static target_ulong getWork(CPUArchState *env, target_ulong ptr, target_ulong sz
         return -1;
     }
 
-//    if (!pm_classified) {
-        // TODO
-        /*
-         * TODO validity check
-         * e.g. pm_Event.stat_reg is SR, pm_Event.ctrl_reg is CR
-         */
-/*
-    } else {
-        #define CLASSIFICATION_NOT_IMPLEMENTED
-        #if defined CLASSIFICATION_NOT_IMPLEMENTED
-        // Omitted fileds are 0'ed
-        static pm_Peripheral peri = {
-            .base_addr = 0x40004800,
-            .regs = {
-                {.type = SR},
-                {.type = DR},
-                {.type = UC},
-                {.type = CR},
-                {.type = CR},
-                {.type = CR},
-                {.type = UC},
-            },
-            .DR_bytes_num = 2,
-            .events = {
-                {.type = EVT_RXNE, .stat_reg = 0, .stat_bit = 5, .ctrl_reg = 3, .ctrl_bit = 5},
-                {.type = EVT_TXE, .stat_reg = 0, .stat_bit = 7, .ctrl_reg = 3, .ctrl_bit = 7},
-                {.type = EVT_TC, .stat_reg = 0, .stat_bit = 6, .ctrl_reg = 3, .ctrl_bit = 6},
-            },
-            .evt_num = 3,
-        };
-        pm_PeripheralList = &peri;
-
-        #else
-        FILE *f = fopen("");
-        pm_PeripheralList = pm_load_model(f);
-        #endif // #if defined CLASSIFICATION_NOT_IMPLEMENTED
-    }
-*/
-
     return retsz;
 }
 
@@ -11849,6 +11817,8 @@ target_ulong doneWork(target_ulong val)
 
       // TODO move it to AFL so that AFL can document it
       if (val == 0x71) val = 0;
+      // roll back and wait for next testcase instead, if persistent
+      if (!val && pm_persist) pm_snapshot_next();
       exit(val); /* exit forkserver child */
 /*
     } else {
@@ -11907,12 +11877,145 @@ void helper_aflInterceptPanic(void)
     exit(32);
 }
 
-void gen_aflBBlock(target_ulong pc)
+void helper_pm_bbl_int(void)
+{
+    pm_int_countdown = pm_int_period;
+    if (afl_startfs_invoked)
+        pm_fire_interrupt();
+}
+
+void helper_afl_edge_new(uint32_t idx)
+{
+    afl_edge_new(idx);
+}
+
+// runs before gen_pm_bbl's work, so the wild PC is neither counted nor
+// logged as an AFL edge
+void helper_pm_illegal_exec(void *opaque)
 {
+    TranslationBlock *tb = opaque;
+
+    cur_bbl_s = tb->pc;
+    cur_bbl_e = tb->pc + tb->size;
+    printf("[%x, %x] illegal exec at 0x%x\n", cur_bbl_s, cur_bbl_e, tb->pc);
+    exit(-1);
+}
+
+static void gen_pm_ld_i32(TCGv_i32 ret, void *p)
+{
+    TCGv_ptr ptr = tcg_const_ptr(p);
+    tcg_gen_ld_i32(ret, ptr, 0);
+    tcg_temp_free_ptr(ptr);
+}
+
+static void gen_pm_st_i32(TCGv_i32 val, void *p)
+{
+    TCGv_ptr ptr = tcg_const_ptr(p);
+    tcg_gen_st_i32(val, ptr, 0);
+    tcg_temp_free_ptr(ptr);
+}
+
+// cur_bbl_e isn't known until the TB is translated, see gen_aflBBlockEnd
+static TCGArg *pm_bbl_e_arg;
+
+/*
+ * P2IM: when pm_tb_inline(), the work cpu_tb_exec does after each TB is
+ * done at the start of the next TB, so that TBs can be chained:
+ * interrupt firing, bbl_cnt, cur_bbl_s/e and AFL edge logging.
+ * bbl_cnt keeps counting finished BBLs only, cpu_exec uncounts a TB that
+ * is left by longjmp.
+ */
+static void gen_pm_bbl(TranslationBlock *tb)
+{
+    TCGLabel *no_int = gen_new_label();
+    TCGv_i32 t = tcg_temp_new_i32();
+    int i;
+
+    gen_pm_ld_i32(t, &pm_bbl_started);
+    gen_pm_st_i32(t, (void *)&bbl_cnt);
+
+    // one interrupt every pm_int_period BBL, taken before this TB
+    gen_pm_ld_i32(t, &pm_int_countdown);
+    tcg_gen_brcondi_i32(TCG_COND_NE, t, 0, no_int);
+    gen_helper_pm_bbl_int();
+    tcg_gen_ld_i32(t, cpu_env, offsetof(CPUState, tcg_exit_req) - ENV_OFFSET);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, t, 0, no_int);
+    tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
+    gen_set_label(no_int);
+
+    gen_pm_ld_i32(t, &pm_int_countdown);
+    tcg_gen_subi_i32(t, t, 1);
+    gen_pm_st_i32(t, &pm_int_countdown);
+
+    gen_pm_ld_i32(t, &pm_bbl_started);
+    tcg_gen_addi_i32(t, t, 1);
+    gen_pm_st_i32(t, &pm_bbl_started);
+
+    tcg_gen_movi_i32(t, tb->pc);
+    gen_pm_st_i32(t, &cur_bbl_s);
+    // fixed up like icount_arg in gen_tb_start
+    tcg_gen_movi_i32(t, 0xdeadbeef);
+    i = tcg_ctx.gen_last_op_idx;
+    i = tcg_ctx.gen_op_buf[i].args;
+    pm_bbl_e_arg = &tcg_ctx.gen_opparam_buf[i + 1];
+    gen_pm_st_i32(t, &cur_bbl_e);
+
+    // afl_tcg_area[afl_loc ^ afl_prev_loc]++, same as helper_aflMaybeLog
+    if (tb->afl_inst) {
+        TCGv_ptr area = tcg_temp_new_ptr(), idx = tcg_temp_new_ptr();
+        TCGv_ptr p = tcg_const_ptr(&afl_tcg_area);
+        TCGLabel *listed = gen_new_label();
+
+        tcg_gen_ld_ptr(area, p, 0);
+        gen_pm_ld_i32(t, &afl_prev_loc);
+        tcg_gen_xori_i32(t, t, tb->afl_loc);
+        tcg_gen_ext_i32_ptr(idx, t);
+        tcg_gen_add_ptr(area, area, idx);
+
+        tcg_gen_ld8u_i32(t, area, 0);
+        tcg_gen_addi_i32(t, t, 1);
+        tcg_gen_st8_i32(t, area, 0);
+        // slot went from 0 to 1, list it for afl-fuzz
+        tcg_gen_brcondi_i32(TCG_COND_NE, t, 1, listed);
+        gen_pm_ld_i32(t, &afl_prev_loc);
+        tcg_gen_xori_i32(t, t, tb->afl_loc);
+        gen_helper_afl_edge_new(t);
+        gen_set_label(listed);
+        tcg_gen_movi_i32(t, tb->afl_loc >> 1);
+        gen_pm_st_i32(t, &afl_prev_loc);
+
+        tcg_temp_free_ptr(p);
+        tcg_temp_free_ptr(idx);
+        tcg_temp_free_ptr(area);
+    }
+
+    tcg_temp_free_i32(t);
+}
+
+// called right after gen_tb_start
+void gen_aflBBlock(TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+
+    afl_tb_loc(tb);
+    if (tb->pm_illegal) {
+        TCGv_ptr t = tcg_const_ptr(tb);
+        gen_helper_pm_illegal_exec(t);
+        tcg_temp_free_ptr(t);
+    }
+    if (pm_tb_inline())
+        gen_pm_bbl(tb);
     if(pc == aflPanicAddr)
         gen_helper_aflInterceptPanic();
     if(pc == aflDmesgAddr)
         gen_helper_aflInterceptLog(cpu_env);
 }
 
+// called right before gen_tb_end
+void gen_aflBBlockEnd(target_ulong pc_end)
+{
+    if (pm_tb_inline())
+        *pm_bbl_e_arg = pc_end;
+}
+
 
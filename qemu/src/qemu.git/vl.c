@@ -131,6 +131,8 @@ int main(int argc, char **argv)
 #include "verbosity.h"
 #endif
 
+#include "peri-mod/options.h"
+
 #define MAX_VIRTIO_CONSOLES 1
 #define MAX_SCLP_CONSOLES 1
 
@@ -3451,6 +3453,35 @@ int main(int argc, char **argv, char **envp)
                     exit(0x10);
                 }
                 break;
+            case QEMU_OPTION_mmio_trace:
+                if (pm_trace_open((char *)optarg)) {
+                    fprintf(stderr, "fail to open mmio trace file!\n");
+                    exit(0x10);
+                }
+                break;
+            case QEMU_OPTION_pm_eoi:
+                if (pm_eoi_parse((char *)optarg)) {
+                    fprintf(stderr, "Invalid pm-eoi val: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case QEMU_OPTION_pm_persist:
+                pm_persist = strtoul(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_pm_int_period:
+                pm_int_period = strtoul(optarg, NULL, 0);
+                if (!pm_int_period) {
+                    fprintf(stderr, "Invalid pm-int-period val: %s\n", optarg);
+                    exit(-1);
+                }
+                pm_int_countdown = pm_int_period;
+                break;
+            case QEMU_OPTION_pm_single_thread:
+                pm_single_thread = 1;
+                break;
+            case QEMU_OPTION_pm_map_size:
+                afl_map_size = strtoul(optarg, NULL, 0);
+                break;
             case QEMU_OPTION_me_bin:
                 me_bin = (char *)optarg;
                 break;
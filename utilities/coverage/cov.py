@@ -45,6 +45,7 @@ def read_config(cfg_f):
         working_dir = parser.get("DEFAULT", "working_dir"),
         queue_base  = parser.get("afl", "output"),
         qemu_exe    = parser.get("qemu", "bin"),
+        int_period  = parser.get("qemu", "int_period", fallback="1000"),
         board       = parser.get("program", "board"),
         mcu         = parser.get("program", "mcu"),
         firmware    = parser.get("program", "img"),
@@ -126,6 +127,7 @@ def inst_cov(cfg):
                     cmd = [cfg.qemu_exe, "-nographic", "-aflFile", rp_f, 
                       "-board", cfg.board, "-mcu", cfg.mcu, "-image", cfg.firmware, 
                       "-pm-stage", "3", "-model-input", args.model_if,
+                      "-pm-int-period", cfg.int_period,
                       # only dump trace on stage 3 for coverage calculation purpose
                       # XXX fclose(trace_f) may not be invoked. According to C 
                       # standard, fclose is invoked at exit()
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+'''
+   P2IM - script to compare fuzzing exec rate of QEMU builds
+   ------------------------------------------------------
+
+   Copyright (C) 2018-2020 RiS3 Lab
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Runs afl-fuzz on one firmware for a fixed time with each QEMU binary
+   given by --qemu, the same way fuzz.py does, and prints the exec rate
+   and the average fork-to-run latency read from fuzzer_stats. Run
+   fuzz.py --no-fuzzing first so the seeds and the peripheral model passed
+   with --model-if exist, e.g.:
+
+     exec_bench.py -c fuzz.cfg --model-if 0.random.1/peripheral_model.json \
+       --qemu before /path/to/old/qemu-system-gnuarmeclipse \
+       --qemu after /path/to/new/qemu-system-gnuarmeclipse
+
+   Only the options every P2IM QEMU knows are passed. The int_period of
+   fuzz.cfg is not, newer QEMUs default to the same 1000 BBLs.
+
+   Like fuzz.py, QEMU is spawned for each input unless --forkserver names
+   the label. Labels given fork server options such as -pm-persist run
+   through the fork server anyway. Only the fork server records fork_us
+   and restore_us, other labels show '-' there.
+
+   --qemu-args adds QEMU options to one label, so the same binary can be
+   measured with and without e.g. -pm-persist:
+
+     exec_bench.py -c fuzz.cfg --model-if 0.random.1/peripheral_model.json \
+       --qemu fork qemu-system-gnuarmeclipse \
+       --qemu persist qemu-system-gnuarmeclipse \
+       --forkserver fork --qemu-args persist "-pm-persist 1000"
+
+'''
+
+import subprocess,sys,os,shutil,signal,time,shlex
+
+import configparser
+import argparse
+
+# QEMU options that only take effect in the fork server
+FORKSRV_OPTS = ["-pm-persist", "-pm-single-thread"]
+
+def read_config(cfg_f):
+    if not os.path.isfile(cfg_f):
+        sys.exit("Cannot find the specified configuration file: %s" % cfg_f)
+    parser = configparser.SafeConfigParser()
+    parser.read(cfg_f)
+
+    return argparse.Namespace(
+        working_dir = parser.get("DEFAULT", "working_dir"),
+        afl_bin     = parser.get("afl", "bin"),
+        afl_timeout = parser.get("afl", "timeout"),
+        afl_seed    = parser.get("afl", "input"),
+        board       = parser.get("program", "board"),
+        mcu         = parser.get("program", "mcu"),
+        img         = parser.get("program", "img"),
+        me_bin      = parser.get("model", "bin"),
+    )
+
+def read_stats(fn):
+    stats = {}
+    with open(fn) as f:
+        for line in f:
+            k, _, v = line.partition(":")
+            stats[k.strip()] = v.strip()
+    return stats
+
+def run_one(cfg, args, label, qemu_bin, qemu_args, forkserver):
+    out_dir = os.path.abspath("exec_bench_%s" % label)
+    if os.path.isdir(out_dir):
+        shutil.rmtree(out_dir)
+
+    # same command line as fuzz.py, deterministic stages skipped. Options
+    # newer QEMUs have, like -pm-int-period, only come from --qemu-args so
+    # that a baseline binary can be run too
+    cmd = [cfg.afl_bin, "-i", cfg.afl_seed, "-o", out_dir,
+        "-t", cfg.afl_timeout, "-QQ", "-d",
+        "-a", cfg.me_bin, "-b", args.config, "-c", args.model_if,
+        "-T", "exec_bench_%s" % label,
+        qemu_bin, "-nographic",
+        "-board", cfg.board, "-mcu", cfg.mcu, "-image", cfg.img,
+        "-pm-stage", "3", "-aflFile", "@@"] + qemu_args
+    env = dict(os.environ)
+    if forkserver:
+        # AFL passes model_if to qemu only in no forkserver mode
+        cmd += ["-model-input", args.model_if]
+    else:
+        env["AFL_NO_FORKSRV"] = ''
+    print("cmd: %s" % ' '.join(cmd))
+
+    with open(os.devnull, 'w') as devnull:
+        proc = subprocess.Popen(cmd, stdout=devnull, env=env)
+        time.sleep(args.time)
+        # afl-fuzz writes the final fuzzer_stats on SIGINT
+        proc.send_signal(signal.SIGINT)
+        proc.wait()
+
+    stats = read_stats("%s/fuzzer_stats" % out_dir)
+    execs = int(stats["execs_done"])
+    secs = int(stats["last_update"]) - int(stats["start_time"])
+    if not forkserver:
+        return execs, secs, None, None
+    # restore_us is 0 unless the fork server restores snapshots (-pm-persist)
+    return execs, secs, float(stats["restore_us"]), float(stats["fork_us"])
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Compare exec/s of QEMU builds on one firmware")
+    parser.add_argument("-c", "--config", dest="config", required=True,
+        help="fuzz.cfg of the firmware")
+    parser.add_argument("--model-if", dest="model_if", required=True,
+        help="peripheral model from the last round of model instantiation")
+    parser.add_argument("--qemu", dest="qemu", nargs=2, action="append",
+        required=True, metavar=("LABEL", "BIN"),
+        help="QEMU binary to measure, may be given more than once")
+    parser.add_argument("--qemu-args", dest="qemu_args", nargs=2,
+        action="append", default=[], metavar=("LABEL", "ARGS"),
+        help="extra QEMU options for the binary of LABEL")
+    parser.add_argument("--forkserver", dest="forkserver", action="append",
+        default=[], metavar="LABEL",
+        help="run LABEL through the fork server")
+    parser.add_argument("-t", "--time", dest="time", type=int, default=600,
+        help="seconds to fuzz with each binary. Default: 600")
+
+    args = parser.parse_args()
+    args.config = os.path.abspath(args.config)
+    args.model_if = os.path.abspath(args.model_if)
+
+    cfg = read_config(args.config)
+    os.chdir(cfg.working_dir)
+
+    extra = {}
+    for label, qemu_args in args.qemu_args:
+        extra.setdefault(label, []).extend(shlex.split(qemu_args))
+
+    results = []
+    for label, qemu_bin in args.qemu:
+        qemu_args = extra.get(label, [])
+        forkserver = label in args.forkserver or \
+            any(opt in FORKSRV_OPTS for opt in qemu_args)
+        results.append((label,) + run_one(cfg, args, label, qemu_bin,
+            qemu_args, forkserver))
+
+    print("%-12s%12s%10s%12s%12s%12s" % ("qemu", "execs", "secs", "exec/s",
+        "restore_us", "fork_us"))
+    for label, execs, secs, restore_us, fork_us in results:
+        fsrv = ["-" if v is None else "%.2f" % v
+            for v in (restore_us, fork_us)]
+        print("%-12s%12d%10d%12.2f%12s%12s" % ((label, execs, secs,
+            float(execs) / secs if secs else 0) + tuple(fsrv)))
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+
+'''
+   P2IM - script to decode binary MMIO trace recorded by QEMU -mmio-trace
+   ------------------------------------------------------
+
+   Copyright (C) 2018-2020 RiS3 Lab
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+'''
+
+import sys, struct
+import argparse
+
+# keep in sync with qemu include/peri-mod/mmio-trace.h
+PM_TRACE_MAGIC = 0x52544d50
+PM_TRACE_VERSION = 1
+HDR = struct.Struct("<IIIIQ")
+REC = struct.Struct("<IIIIIIBBBB")
+
+PM_TRACE_R = 0
+PM_TRACE_UNASSIGNED = 0xff
+REG_TYPE = ["UC", "CR", "SR", "DR", "CR+SR"]
+
+
+def decode(rec):
+    bbl_s, bbl_e, addr, val, pm_cnt, cnt, d, prev_type, type_, size = rec
+    prefix = "[%x, %x] %3d-th(total %3d-th) \t" % (bbl_s, bbl_e, pm_cnt, cnt)
+
+    if type_ == PM_TRACE_UNASSIGNED:
+        if d == PM_TRACE_R:
+            return prefix + "unassigned mem_r *0x%x" % addr
+        return prefix + "unassigned mem_w *0x%x = 0x%x" % (addr, val)
+
+    if d == PM_TRACE_R:
+        s = prefix + "pm_r *0x%x gets 0x%x, " % (addr, val)
+    else:
+        s = prefix + "pm_w *0x%x = 0x%x, " % (addr, val)
+    if prev_type == type_:
+        return s + "remains %s" % REG_TYPE[type_]
+    return s + "turns %s into %s" % (REG_TYPE[prev_type], REG_TYPE[type_])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Print MMIO trace recorded "
+        "by QEMU -mmio-trace in the same format as QEMU used to print")
+    parser.add_argument("trace", help="trace file given to -mmio-trace")
+    parser.add_argument("-n", "--last", dest="last", type=int, default=0,
+        help="only print the last N records")
+    args = parser.parse_args()
+
+    # trace may be read while QEMU is writing it, take a snapshot
+    with open(args.trace, "rb") as f:
+        buf = f.read()
+
+    magic, version, rec_size, rec_num, head = HDR.unpack_from(buf, 0)
+    if magic != PM_TRACE_MAGIC or version != PM_TRACE_VERSION:
+        sys.exit("%s is not a version %d MMIO trace" % (args.trace, PM_TRACE_VERSION))
+    if rec_size != REC.size:
+        sys.exit("Unexpected record size %d" % rec_size)
+
+    # ring keeps the last rec_num records
+    start = max(0, head - rec_num)
+    if start and not args.last:
+        print("(%d earlier records were overwritten)" % start, file=sys.stderr)
+    if args.last:
+        start = max(start, head - args.last)
+
+    for i in range(start, head):
+        off = HDR.size + (i % rec_num) * rec_size
+        print(decode(REC.unpack_from(buf, off)))
+
+
+if __name__ == "__main__":
+    main()
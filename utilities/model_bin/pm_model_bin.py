@@ -0,0 +1,337 @@
+#!/usr/bin/env python3
+
+'''
+   P2IM - script to convert peripheral model between JSON and binary
+   ------------------------------------------------------
+
+   Copyright (C) 2018-2020 RiS3 Lab
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+'''
+
+import sys, os, json
+import argparse
+from ctypes import *
+
+# keep in sync with qemu include/peri-mod/peri-mod.h
+PM_MODEL_BIN_MAGIC = 0x424d4d50
+PM_MODEL_BIN_VERSION = 3
+PM_MODEL_BIN_SR_READ = 0x1
+PM_MODEL_BIN_AUP = 0x2
+
+PM_MAX_SATISFY_NUM = 16
+PM_MAX_BIT_COMB_SZ = 3
+PM_SET_BITS = 3
+PM_PERI_ADDR_RANGE = 1 << 9
+PM_MAX_REG_NUM = PM_PERI_ADDR_RANGE
+PM_MAX_EVT_NUM = 0xfffe
+
+SR = 2
+DR = 3
+CR_SR = 4
+
+
+class CRVal(Structure):
+    _fields_ = [("idx", c_int), ("val", c_uint32)]
+
+class Event(Structure):
+    _fields_ = [
+        ("bbl_e", c_uint32),
+        ("cr_key", c_uint32), # computed by QEMU
+        ("cr_num", c_uint16),
+        ("r_idx", c_uint8),
+        ("sr_num", c_uint8),
+        ("set_bits", c_uint8),
+        ("satisfy_num", c_uint8),
+        ("cur_satisfy", c_uint8),
+        ("cur_sr", c_uint8),
+        ("CR_val", c_void_p), # offsets in the image
+        ("satisfy", c_void_p),
+    ]
+
+class MMIORegister(Structure):
+    _fields_ = [
+        ("type", c_uint8),
+        ("sr_locked", c_uint8),
+        ("val_b", c_uint8 * 4),
+        ("dr_bytes", c_uint8),
+        ("r_idx_in_bbl", c_int),
+        ("last_r_bbl_cnt", c_int),
+    ]
+
+class MMIORegCold(Structure):
+    _fields_ = [
+        ("cr_val", c_uint32),
+        ("read", c_int),
+        ("write", c_int),
+    ]
+
+class Peripheral(Structure):
+    _fields_ = [
+        ("base_addr", c_uint32),
+        ("reg_size", c_uint),
+        ("regs", c_void_p), # offsets in the image
+        ("regs_cold", c_void_p),
+        ("max_reg_idx", c_int),
+        ("reg_cap", c_int),
+        ("cr_key", c_uint32), # computed by QEMU
+        ("cr_num", c_int),
+        ("events", c_void_p),
+        ("evt_num", c_uint),
+        ("evt_hash", c_void_p), # built by QEMU
+        ("evt_hash_mask", c_uint),
+        ("mr", c_void_p),
+        ("next", c_void_p),
+    ]
+
+class ModelBinHdr(Structure):
+    _fields_ = [
+        ("magic", c_uint32),
+        ("version", c_uint32),
+        ("hdr_size", c_uint32),
+        ("flags", c_uint32),
+        ("peri_size", c_uint32),
+        ("evt_size", c_uint32),
+        ("reg_size", c_uint32),
+        ("reg_cold_size", c_uint32),
+        ("json_size", c_uint64),
+        ("json_mtime_ns", c_int64),
+        ("peri_num", c_uint32),
+        ("srr_site", c_uint32),
+        ("CR_SR_r_idx", c_int32),
+        ("target_bbl_cnt", c_uint32),
+        ("sr_func_ret_num", c_uint32),
+        ("replay_bbl_cnt", c_uint32),
+    ]
+
+
+def bin_path(json_f):
+    if json_f.endswith(".json"):
+        return json_f[:-len(".json")] + ".bin"
+    return json_f + ".bin"
+
+def satisfy_len(e):
+    return e.satisfy_num * e.sr_num * (e.set_bits + 1)
+
+def parse_peri(base_addr, jperi):
+    # returns (peri, regs, regs_cold, [(event, CR_val array, satisfy array)])
+    peri = Peripheral()
+    peri.base_addr = int(base_addr, 0)
+    peri.reg_size = jperi["reg_size"]
+
+    jregs = jperi["regs"]
+    if len(jregs) > PM_MAX_REG_NUM:
+        sys.exit("Too many registers in peripheral %s" % base_addr)
+    peri.max_reg_idx = len(jregs) - 1
+    peri.reg_cap = len(jregs)
+    regs = (MMIORegister * len(jregs))()
+    regs_cold = (MMIORegCold * len(jregs))()
+    for i, jreg in enumerate(jregs):
+        regs[i].type = jreg["type"]
+        regs_cold[i].read = jreg.get("read", 0)
+        regs_cold[i].write = jreg.get("write", 0)
+        if regs[i].type in (SR, CR_SR):
+            regs[i].sr_locked = jreg["sr_locked"]
+        regs[i].dr_bytes = jreg.get("dr_bytes", 0)
+
+    events = []
+    for CR_val, jval0 in jperi["events"].items():
+        crs = CR_val.split(",") if CR_val else []
+        for bbl_e, jval in jval0.items():
+            e = Event()
+            cv = (CRVal * len(crs))()
+            for k, cr in enumerate(crs):
+                idx, val = cr.split(":")
+                cv[k].idx = int(idx)
+                cv[k].val = int(val, 0)
+            e.cr_num = len(crs)
+
+            e.bbl_e = int(bbl_e, 0)
+            e.sr_num = jval["sr_num"]
+            e.set_bits = jval["set_bits"]
+            e.r_idx = jval.get("CR_SR_r_idx", 0)
+
+            satisfy = jval["satisfy"]
+            if len(satisfy) > PM_MAX_SATISFY_NUM:
+                sys.exit("Too many bit combinations in satisfy")
+            e.satisfy_num = len(satisfy)
+            sat = (c_uint8 * satisfy_len(e))()
+            w = e.set_bits + 1
+            for k, bc in enumerate(satisfy):
+                # [bits of SR0, set/clear of SR0, bits of SR1, ...]
+                for l in range(0, len(bc), 2):
+                    base = (k * e.sr_num + l//2) * w
+                    bits = bc[l]
+                    for b in range(e.set_bits):
+                        sat[base + b + 1] = bits[b]
+                    sat[base] = bc[l+1]
+            events.append((e, cv, sat))
+    if len(events) > PM_MAX_EVT_NUM:
+        sys.exit("Too many events in peripheral %s" % base_addr)
+    peri.evt_num = len(events)
+    return peri, regs, regs_cold, events
+
+class Image:
+    # arrays are 8-byte aligned, pointers hold their offsets
+    def __init__(self, off):
+        self.buf = bytearray(off)
+
+    def put(self, obj):
+        if not sizeof(obj):
+            return None
+        self.buf += bytes(-len(self.buf) % 8)
+        off = len(self.buf)
+        self.buf += bytes(obj)
+        return off
+
+def json2bin(json_f, bin_f):
+    with open(json_f) as f:
+        root = json.load(f)
+    st = os.stat(json_f)
+
+    peris = [parse_peri(ba, jperi) for ba, jperi in root["model"].items()]
+
+    hdr = ModelBinHdr()
+    hdr.magic = PM_MODEL_BIN_MAGIC
+    hdr.version = PM_MODEL_BIN_VERSION
+    hdr.hdr_size = sizeof(ModelBinHdr)
+    hdr.peri_size = sizeof(Peripheral)
+    hdr.evt_size = sizeof(Event)
+    hdr.reg_size = sizeof(MMIORegister)
+    hdr.reg_cold_size = sizeof(MMIORegCold)
+    hdr.peri_num = len(peris)
+    hdr.json_size = st.st_size
+    hdr.json_mtime_ns = st.st_mtime_ns
+
+    ret_addr = []
+    srr = root.get("sr_read")
+    if srr and "sr_func_ret_addr" in srr:
+        # only SR_R_EXPLORE consumes sr_read, where sr_func_ret_addr is added
+        hdr.flags |= PM_MODEL_BIN_SR_READ
+        hdr.srr_site = srr["bbl_e"]
+        hdr.CR_SR_r_idx = srr["CR_SR_r_idx"]
+        hdr.target_bbl_cnt = srr["bbl_cnt"]
+        ret_addr = srr["sr_func_ret_addr"]
+        hdr.sr_func_ret_num = len(ret_addr)
+    aup = root.get("access_to_unmodeled_peri")
+    if aup:
+        hdr.flags |= PM_MODEL_BIN_AUP
+        hdr.replay_bbl_cnt = aup["replay_bbl_cnt"]
+
+    img = Image(sizeof(ModelBinHdr) + sizeof(Peripheral) * len(peris))
+    img.buf += bytes((c_uint32 * len(ret_addr))(*ret_addr))
+    for peri, regs, regs_cold, events in peris:
+        peri.regs = img.put(regs)
+        peri.regs_cold = img.put(regs_cold)
+        # same order as QEMU: events, then CR_val and satisfy of each event
+        evts = (Event * len(events))()
+        peri.events = img.put(evts)
+        for k, (e, cv, sat) in enumerate(events):
+            e.CR_val = img.put(cv)
+            e.satisfy = img.put(sat)
+            evts[k] = e
+        if events:
+            img.buf[peri.events:peri.events + sizeof(evts)] = bytes(evts)
+    img.buf[:sizeof(ModelBinHdr)] = bytes(hdr)
+    for i, (peri, _, _, _) in enumerate(peris):
+        off = sizeof(ModelBinHdr) + i * sizeof(Peripheral)
+        img.buf[off:off + sizeof(Peripheral)] = bytes(peri)
+
+    tmp = "%s.%d" % (bin_f, os.getpid())
+    with open(tmp, "wb") as f:
+        f.write(img.buf)
+    os.rename(tmp, bin_f)
+
+def bin2json(bin_f, json_f):
+    with open(bin_f, "rb") as f:
+        buf = f.read()
+
+    hdr = ModelBinHdr.from_buffer_copy(buf)
+    if hdr.magic != PM_MODEL_BIN_MAGIC or hdr.version != PM_MODEL_BIN_VERSION:
+        sys.exit("%s is not a version %d binary model" % (bin_f, PM_MODEL_BIN_VERSION))
+    if (hdr.peri_size, hdr.evt_size, hdr.reg_size, hdr.reg_cold_size) != \
+       (sizeof(Peripheral), sizeof(Event), sizeof(MMIORegister), sizeof(MMIORegCold)):
+        sys.exit("%s is built with a different struct layout" % bin_f)
+
+    def arr(typ, off, n):
+        return (typ * n).from_buffer_copy(buf, off) if n else []
+
+    model = {}
+    for i in range(hdr.peri_num):
+        peri = Peripheral.from_buffer_copy(buf, hdr.hdr_size + i * hdr.peri_size)
+        regs = arr(MMIORegister, peri.regs, peri.reg_cap)
+        regs_cold = arr(MMIORegCold, peri.regs_cold, peri.reg_cap)
+        jregs = []
+        for j in range(peri.max_reg_idx + 1):
+            reg = regs[j]
+            jreg = {"type": reg.type}
+            if reg.type:
+                jreg["read"] = regs_cold[j].read
+                jreg["write"] = regs_cold[j].write
+                if reg.type in (SR, CR_SR):
+                    jreg["sr_locked"] = reg.sr_locked
+                if reg.type == DR and reg.dr_bytes:
+                    jreg["dr_bytes"] = reg.dr_bytes
+            jregs.append(jreg)
+
+        events = {}
+        for e in arr(Event, peri.events, peri.evt_num):
+            cv = arr(CRVal, e.CR_val, e.cr_num)
+            sat = arr(c_uint8, e.satisfy, satisfy_len(e))
+            CR_val = ",".join("%d:0x%x" % (c.idx, c.val) for c in cv)
+            w = e.set_bits + 1
+            satisfy = []
+            for k in range(e.satisfy_num):
+                bc = []
+                for l in range(e.sr_num):
+                    base = (k * e.sr_num + l) * w
+                    bc.append([sat[base + b + 1] for b in range(e.set_bits)])
+                    bc.append(sat[base])
+                satisfy.append(bc)
+            jval = {"sr_num": e.sr_num, "set_bits": e.set_bits, "satisfy": satisfy}
+            if e.r_idx:
+                jval["CR_SR_r_idx"] = e.r_idx
+            events.setdefault(CR_val, {})["0x%x" % e.bbl_e] = jval
+
+        model["0x%x" % peri.base_addr] = {"reg_size": peri.reg_size,
+            "regs": jregs, "events": events}
+
+    root = {"model": model}
+    if hdr.flags & PM_MODEL_BIN_SR_READ:
+        off = hdr.hdr_size + hdr.peri_num * hdr.peri_size
+        ret_addr = arr(c_uint32, off, hdr.sr_func_ret_num)
+        root["sr_read"] = {"bbl_e": hdr.srr_site, "CR_SR_r_idx": hdr.CR_SR_r_idx,
+            "bbl_cnt": hdr.target_bbl_cnt, "sr_func_ret_addr": list(ret_addr)}
+    if hdr.flags & PM_MODEL_BIN_AUP:
+        root["access_to_unmodeled_peri"] = {"replay_bbl_cnt": hdr.replay_bbl_cnt}
+
+    with open(json_f, "w") as f:
+        json.dump(root, f, indent=4)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert peripheral model "
+        "between JSON and the binary form QEMU mmaps. QEMU looks for foo.bin "
+        "next to foo.json. bin2json is meant for inspection, fields QEMU "
+        "doesn't load (e.g. interrupts) are not in the binary.")
+    parser.add_argument("cmd", choices=["json2bin", "bin2json"])
+    parser.add_argument("input")
+    parser.add_argument("output", nargs="?",
+        help="defaults to foo.bin for json2bin of foo.json")
+    args = parser.parse_args()
+
+    if args.cmd == "json2bin":
+        json2bin(args.input, args.output or bin_path(args.input))
+    else:
+        if not args.output:
+            sys.exit("output JSON is required for bin2json")
+        bin2json(args.input, args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,137 @@
+/*
+   P2IM - peripheral lookup microbenchmark
+   ------------------------------------------------------
+
+   Copyright (C) 2018-2020 RiS3 Lab
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Times get_peri(), the lookup QEMU does on every MMIO access, with the
+   list walk it used to do and with the two-level table, for 1 to 64
+   modeled peripherals. Build and run:
+
+     gcc -O2 peri_lookup_bench.c -o peri_lookup_bench
+     ./peri_lookup_bench
+
+   Lookups go through a function pointer, so call overhead is included in
+   both columns.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+// keep in sync with qemu include/peri-mod/peri-mod.h
+#define PM_PERI_ADDR_BITS 9
+#define PM_PERI_ADDR_RANGE (1 << PM_PERI_ADDR_BITS)
+#define PM_PERI_REGION_BASE 0x40000000U
+#define PM_PERI_REGION_BITS 29
+#define PM_PERI_IDX_BITS (PM_PERI_REGION_BITS - PM_PERI_ADDR_BITS)
+#define PM_PERI_L2_BITS 10
+#define PM_PERI_L1_BITS (PM_PERI_IDX_BITS - PM_PERI_L2_BITS)
+#define PM_PERI_L1_SIZE (1 << PM_PERI_L1_BITS)
+#define PM_PERI_L2_SIZE (1 << PM_PERI_L2_BITS)
+
+#define MAX_PERIS 64
+#define LOOKUPS (1 << 24)
+
+typedef uint32_t target_ulong;
+
+typedef struct pm_Peripheral {
+    target_ulong base_addr;
+    struct pm_Peripheral *next;
+} pm_Peripheral;
+
+static pm_Peripheral *pm_PeripheralList;
+static pm_Peripheral **pm_peri_table[PM_PERI_L1_SIZE];
+
+// before: walk the list on every access
+static pm_Peripheral *get_peri_list(target_ulong reg_addr) {
+    pm_Peripheral *peri = pm_PeripheralList;
+    target_ulong base_addr = reg_addr & ~(PM_PERI_ADDR_RANGE - 1);
+    while(peri) {
+        if (peri->base_addr == base_addr)
+            break;
+        peri = peri->next;
+    }
+    return peri;
+}
+
+// after: same as get_peri() in peri-mod.h
+static pm_Peripheral *get_peri_table(target_ulong reg_addr) {
+    target_ulong idx = reg_addr - PM_PERI_REGION_BASE;
+    pm_Peripheral **l2;
+
+    if (idx >> PM_PERI_REGION_BITS)
+        return NULL;
+    idx >>= PM_PERI_ADDR_BITS;
+    l2 = pm_peri_table[idx >> PM_PERI_L2_BITS];
+    return l2 ? l2[idx & (PM_PERI_L2_SIZE - 1)] : NULL;
+}
+
+static void table_insert(pm_Peripheral *peri) {
+    target_ulong idx = (peri->base_addr - PM_PERI_REGION_BASE) >>
+        PM_PERI_ADDR_BITS;
+    pm_Peripheral ***l1 = &pm_peri_table[idx >> PM_PERI_L2_BITS];
+
+    if (!*l1)
+        *l1 = calloc(PM_PERI_L2_SIZE, sizeof(pm_Peripheral *));
+    (*l1)[idx & (PM_PERI_L2_SIZE - 1)] = peri;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// n must be a power of 2
+static double time_lookup(pm_Peripheral *(*lookup)(target_ulong),
+                          target_ulong *addrs, int n) {
+    static volatile uintptr_t sink;
+    uint64_t start = now_ns();
+    int i;
+
+    for (i = 0; i < LOOKUPS; i++)
+        sink += (uintptr_t)lookup(addrs[i & (n - 1)]);
+    return (double)(now_ns() - start) / LOOKUPS;
+}
+
+int main(void) {
+    static pm_Peripheral peris[MAX_PERIS];
+    int num, i;
+
+    // a STM32-like layout: APB1 at 0x40000000, APB2 at 0x40010000, ...
+    for (i = 0; i < MAX_PERIS; i++)
+        peris[i].base_addr = PM_PERI_REGION_BASE + (i / 16) * 0x10000 +
+            (i % 16) * 0x400;
+
+    printf("%-12s%12s%12s\n", "peripherals", "list (ns)", "table (ns)");
+
+    for (num = 1; num <= MAX_PERIS; num *= 2) {
+        target_ulong sel[MAX_PERIS * 16];
+
+        // the list is built the way create_peri() does, newest first
+        pm_PeripheralList = NULL;
+        for (i = 0; i < num; i++) {
+            peris[i].next = pm_PeripheralList;
+            pm_PeripheralList = &peris[i];
+            table_insert(&peris[i]);
+        }
+        // access only the peripherals in the model
+        for (i = 0; i < num * 16; i++)
+            sel[i] = peris[i % num].base_addr + (i / num % 16) * 4;
+
+        printf("%-12d%12.1f%12.1f\n", num,
+            time_lookup(get_peri_list, sel, num * 16),
+            time_lookup(get_peri_table, sel, num * 16));
+    }
+
+    return 0;
+}